@@ -19,9 +19,13 @@
 #include <common.h>
 
 void cpu_exec(uint64_t n);
+void cpu_reset();
+void cpu_request_attention();
 
 void set_nemu_state(int state, vaddr_t pc, int halt_ret);
 void invalid_inst(vaddr_t thispc);
+void cpu_invalidate_code(vaddr_t addr, int len);
+void cpu_flush_code();
 
 #define NEMUTRAP(thispc, code) set_nemu_state(NEMU_END, thispc, code)
 #define INV(thispc) invalid_inst(thispc)
@@ -0,0 +1,90 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_DECODE_CACHE_H__
+#define __CPU_DECODE_CACHE_H__
+
+#include <cpu/decode.h>
+#include <memory/vaddr.h>
+
+#define DCACHE_NR_ENTRY CONFIG_DECODE_CACHE_SIZE
+static_assert((DCACHE_NR_ENTRY & (DCACHE_NR_ENTRY - 1)) == 0,
+    "the size of the decode cache should be a power of 2");
+
+// the length of the longest instruction of the ISA
+#define ISA_MAX_ILEN MUXDEF(CONFIG_ISA_x86, 15, 4)
+
+typedef struct DecodeCacheEntry {
+  vaddr_t pc;
+  const void *handler; // the body matched in decode_exec(), NULL if the entry is invalid
+  const char *name;    // the name of the pattern matched
+  ISADecodeInfo isa;
+  DecodeOperand op;
+  int ilen;
+} DecodeCacheEntry;
+
+extern DecodeCacheEntry dcache[DCACHE_NR_ENTRY];
+extern uint64_t g_dcache_hit, g_dcache_miss;
+
+void dcache_invalidate(vaddr_t addr, int len);
+void dcache_flush();
+
+static inline DecodeCacheEntry* dcache_entry(vaddr_t pc) {
+  // instructions are at least 2-byte aligned, and most of them are 4-byte aligned
+  return &dcache[(pc >> 2) & (DCACHE_NR_ENTRY - 1)];
+}
+
+// Let isa_exec_once() execute the decoded instruction `e` at `s->pc`
+// without fetching it again.
+static inline void dcache_use(Decode *s, DecodeCacheEntry *e) {
+  s->isa = e->isa;
+  s->snpc = s->pc + e->ilen;
+  s->dc = e;
+}
+
+// If `s->pc` hits, prepare `s` with dcache_use(). Otherwise
+// isa_exec_once() will fetch and decode the instruction.
+static inline bool dcache_lookup(Decode *s) {
+  DecodeCacheEntry *e = dcache_entry(s->pc);
+  if (likely(e->pc == s->pc && e->handler != NULL)) {
+    dcache_use(s, e);
+    g_dcache_hit ++;
+    return true;
+  }
+  s->dc = NULL;
+  g_dcache_miss ++;
+  return false;
+}
+
+static inline void dcache_fill(Decode *s, DecodeOperand *op, const void *handler, const char *name) {
+  DecodeCacheEntry *e = dcache_entry(s->pc);
+  e->pc = s->pc;
+  e->handler = handler;
+  e->name = name;
+  e->isa = s->isa;
+  e->op = *op;
+  e->ilen = s->snpc - s->pc;
+  vaddr_mark_code(s->pc, e->ilen);
+}
+
+/* Check whether `e` was matched by the pattern `name`. Code which runs
+ * an instruction without its body, such as fused pairs and the JIT,
+ * must check this, so that it never runs other semantics than the body.
+ */
+static inline bool dcache_is(const DecodeCacheEntry *e, const char *name) {
+  return e->handler != NULL && strcmp(e->name, name) == 0;
+}
+
+#endif
@@ -18,11 +18,19 @@
 
 #include <isa.h>
 
+// operand fields extracted from the instruction by decode_operand()
+typedef struct {
+  int rd;
+  int rs1, rs2; // register indices of the sources, 0 if not used
+  word_t imm;
+} DecodeOperand;
+
 typedef struct Decode {
   vaddr_t pc;
   vaddr_t snpc; // static next pc
   vaddr_t dnpc; // dynamic next pc
   ISADecodeInfo isa;
+  IFDEF(CONFIG_DECODE_CACHE, struct DecodeCacheEntry *dc); // decoded instruction to execute, NULL to fetch
   IFDEF(CONFIG_ITRACE, char logbuf[128]);
 } Decode;
 
@@ -86,17 +94,75 @@ finish:
 }
 
 
+#ifdef CONFIG_DECODE_PROFILE
+typedef struct InstpatCounter {
+  const char *pattern;
+  uint64_t count;
+  struct InstpatCounter *next;
+} InstpatCounter;
+
+void instpat_profile_add(InstpatCounter *c);
+
+// Each pattern owns a counter, which is registered when it first matches.
+#define INSTPAT_PROFILE(str) do { \
+  static InstpatCounter __counter = { .pattern = str }; \
+  if (__counter.count ++ == 0) instpat_profile_add(&__counter); \
+} while (0)
+#else
+#define INSTPAT_PROFILE(str)
+#endif
+
 // --- pattern matching wrappers for decode ---
 #define INSTPAT(pattern, ...) do { \
   uint64_t key, mask, shift; \
   pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift); \
   if ((((uint64_t)INSTPAT_INST(s) >> shift) & mask) == key) { \
+    INSTPAT_PROFILE(pattern); \
     INSTPAT_MATCH(s, ##__VA_ARGS__); \
     goto *(__instpat_end); \
   } \
 } while (0)
 
-#define INSTPAT_START(name) { const void ** __instpat_end = &&concat(__instpat_end_, name);
-#define INSTPAT_END(name)   concat(__instpat_end_, name): ; }
+#ifdef CONFIG_DECODE_CACHE
+#include <cpu/decode-cache.h>
+
+// On a hit, restore the operands `op` of decode_exec() and jump to the
+// matched body directly, skipping all patterns before it.
+#define INSTPAT_CACHE_DISPATCH(s) \
+  if ((s)->dc != NULL) { op = (s)->dc->op; goto *((s)->dc->handler); }
+
+// Used by INSTPAT_MATCH() between decode_operand() and the execute body.
+#define INSTPAT_CACHE(s, op, name) \
+  dcache_fill(s, &(op), &&concat(__instpat_body_, __LINE__), str(name)); \
+  concat(__instpat_body_, __LINE__):
+#else
+#define INSTPAT_CACHE_DISPATCH(s)
+#define INSTPAT_CACHE(s, op, name)
+#endif
+
+#ifdef CONFIG_THREADED_DISPATCH
+// set by exec_block() to the end of the entries to run, NULL if not running a block
+extern struct DecodeCacheEntry *g_thread_end;
+
+// After an execute body, jump to the body of the next entry of the block
+// directly if it is the next instruction to run.
+#define INSTPAT_THREAD_NEXT(s) \
+  if (g_thread_end != NULL) { \
+    struct DecodeCacheEntry *__next = (s)->dc + 1; \
+    if (__next < g_thread_end && __next->pc == (s)->dnpc && nemu_state.state == NEMU_RUNNING) { \
+      cpu.pc = (s)->pc = (s)->dnpc; \
+      dcache_use(s, __next); \
+      (s)->dnpc = (s)->snpc; \
+      op = __next->op; \
+      goto *(__next->handler); \
+    } \
+  }
+#else
+#define INSTPAT_THREAD_NEXT(s)
+#endif
+
+#define INSTPAT_START(name) { const void ** __instpat_end = &&concat(__instpat_end_, name); \
+  INSTPAT_CACHE_DISPATCH(s);
+#define INSTPAT_END(name)   concat(__instpat_end_, name): INSTPAT_THREAD_NEXT(s); }
 
 #endif
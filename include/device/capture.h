@@ -0,0 +1,32 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_CAPTURE_H__
+#define __DEVICE_CAPTURE_H__
+
+#include <common.h>
+
+// Set by the monitor from the options before the devices are initialized.
+void capture_set(const char *dir, int every, const char *golden);
+
+/* Start capturing frames of `w` x `h` pixels, and return false if no
+ * directory is given by --capture.
+ */
+bool capture_init(int w, int h);
+
+// Record a sync of the screen, `dirty` if vmem was written since the last one.
+void capture_frame(const uint32_t *fb, bool dirty);
+
+#endif
@@ -0,0 +1,61 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_EVENT_H__
+#define __DEVICE_EVENT_H__
+
+#include <common.h>
+
+#define TIMER_HZ 60
+
+/* Devices schedule their work as events on a single queue ordered by
+ * deadline. Deadlines are counted in guest instructions, so the CPU only
+ * has to run up to `event_next` and then call event_run(). An event may
+ * also be scheduled in virtual time, in us, which is converted to
+ * instructions by the speed of the guest measured so far, or exactly
+ * with --icount. If it comes early, it is put off again rather than
+ * handled.
+ */
+typedef struct Event {
+  const char *name;
+  void (*handler)(struct Event *e);
+  uint64_t when;    // deadline in guest instructions
+  uint64_t when_us; // deadline in virtual time, or 0 if scheduled by event_add()
+  int idx;          // index in the queue, or -1 if not scheduled
+} Event;
+
+#define EVENT_INIT(_name, _handler) { .name = _name, .handler = _handler, .idx = -1 }
+
+// the earliest deadline of all scheduled events
+extern uint64_t event_next;
+
+// (re)schedule `e` to `n` guest instructions from now
+void event_add(Event *e, uint64_t n);
+// (re)schedule `e` to `us` us of virtual time from now
+void event_add_us(Event *e, uint64_t us);
+void event_del(Event *e);
+// the virtual time in us, the host time unless --icount is given
+uint64_t event_time();
+// derive the virtual time from the instruction count, 2^shift ns each
+void event_set_icount(int shift);
+
+// start measuring the speed of the guest as the CPU starts running
+void event_start();
+// handle the events whose deadlines are reached
+void event_run();
+// shift the deadlines as the instruction count drops by `n`
+void event_rebase(uint64_t n);
+
+#endif
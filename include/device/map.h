@@ -28,8 +28,16 @@ typedef struct {
   paddr_t high;
   void *space;
   io_callback_t callback;
+  bool passive;   // see MAP_PASSIVE
+  uint8_t *dirty; // of a passive map, a byte for each page of its space written since map_fetch_dirty()
 } IOMap;
 
+/* Flags of add_mmio_map(). A MAP_PASSIVE map is plain memory with no
+ * callback: the memory fast paths may access its space directly as RAM,
+ * only recording the pages written for the consumer of the device.
+ */
+#define MAP_PASSIVE 0x1
+
 static inline bool map_inside(IOMap *map, paddr_t addr) {
   return (addr >= map->low && addr <= map->high);
 }
@@ -37,10 +45,7 @@ static inline bool map_inside(IOMap *map, paddr_t addr) {
 static inline int find_mapid_by_addr(IOMap *maps, int size, paddr_t addr) {
   int i;
   for (i = 0; i < size; i ++) {
-    if (map_inside(maps + i, addr)) {
-      difftest_skip_ref();
-      return i;
-    }
+    if (map_inside(maps + i, addr)) return i;
   }
   return -1;
 }
@@ -48,7 +53,12 @@ static inline int find_mapid_by_addr(IOMap *maps, int size, paddr_t addr) {
 void add_pio_map(const char *name, ioaddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
 void add_mmio_map(const char *name, paddr_t addr,
-        void *space, uint32_t len, io_callback_t callback);
+        void *space, uint32_t len, io_callback_t callback, int flags);
+bool map_fetch_dirty(void *space, uint8_t *pages);
+#ifdef CONFIG_PMEM_WINDOW
+// map [space, space + len) of the I/O space again at `haddr`
+void map_alias(void *space, void *haddr, size_t len);
+#endif
 
 word_t map_read(paddr_t addr, int len, IOMap *map);
 void map_write(paddr_t addr, int len, word_t data, IOMap *map);
@@ -20,5 +20,33 @@
 
 word_t mmio_read(paddr_t addr, int len);
 void mmio_write(paddr_t addr, int len, word_t data);
+uint8_t* mmio_passive_page(paddr_t page, bool is_write);
+
+/* The MAP_PASSIVE map accessed last by mmio_read()/mmio_write(). Later
+ * accesses falling in it are done on its space directly, and stores mark
+ * the pages written in `dirty`. Include memory/paddr.h for this.
+ */
+typedef struct {
+  paddr_t low;
+  uint64_t size;
+  uint8_t *space;
+  uint8_t *dirty;
+} MMIOPassive;
+extern MMIOPassive mmio_passive;
+
+#if defined(CONFIG_DEVICE) && !defined(CONFIG_DIFFTEST)
+static inline uint8_t* mmio_passive_host(paddr_t addr, int len, bool is_write) {
+  paddr_t offset = addr - mmio_passive.low;
+  if ((uint64_t)offset + len > mmio_passive.size) return NULL;
+  if (is_write) {
+    mmio_passive.dirty[offset >> PAGE_SHIFT] = 1;
+    mmio_passive.dirty[(offset + len - 1) >> PAGE_SHIFT] = 1;
+  }
+  return mmio_passive.space + offset;
+}
+#else
+// the accesses skipped by the REF should go through mmio_read()/mmio_write()
+static inline uint8_t* mmio_passive_host(paddr_t addr, int len, bool is_write) { return NULL; }
+#endif
 
 #endif
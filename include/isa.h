@@ -27,6 +27,7 @@ typedef concat(__GUEST_ISA__, _ISADecodeInfo) ISADecodeInfo;
 // monitor
 extern unsigned char isa_logo[];
 void init_isa();
+void isa_reset(); // reset the CPU as if NEMU has just started
 
 // reg
 extern CPU_state cpu;
@@ -36,6 +37,13 @@ word_t isa_reg_str2val(const char *name, bool *success);
 // exec
 struct Decode;
 int isa_exec_once(struct Decode *s);
+#ifdef CONFIG_DECODE_FUSION
+#define FUSE_MAX_IDIOM 8 // idioms are numbered from 1, and 0 means not fused
+struct DecodeCacheEntry;
+int isa_fuse(struct DecodeCacheEntry *e);
+const char* isa_fuse_name(int idiom);
+void isa_exec_fused(struct Decode *s, int idiom);
+#endif
 
 // memory
 enum { MMU_DIRECT, MMU_TRANSLATE, MMU_FAIL };
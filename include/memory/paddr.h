@@ -18,20 +18,193 @@
 
 #include <common.h>
 
+#define PAGE_SHIFT        12
+#define PAGE_SIZE         (1ul << PAGE_SHIFT)
+#define PAGE_MASK         (PAGE_SIZE - 1)
+
+// it uses PAGE_SHIFT
+#include <device/mmio.h>
+
 #define PMEM_LEFT  ((paddr_t)CONFIG_MBASE)
 #define PMEM_RIGHT ((paddr_t)CONFIG_MBASE + CONFIG_MSIZE - 1)
 #define RESET_VECTOR (PMEM_LEFT + CONFIG_PC_RESET_OFFSET)
 
+#ifdef CONFIG_PMEM_GARRAY
+extern uint8_t pmem[];
+#else // CONFIG_PMEM_MALLOC || CONFIG_PMEM_MMAP
+extern uint8_t *pmem;
+#endif
+
+#ifdef CONFIG_PMEM_WINDOW
+#define PMEM_WINDOW_SIZE (1ull << 32)
+#endif
+
 /* convert the guest physical address in the guest program to host virtual address in NEMU */
-uint8_t* guest_to_host(paddr_t paddr);
+static inline uint8_t* guest_to_host(paddr_t paddr) { return pmem + paddr - CONFIG_MBASE; }
 /* convert the host virtual address in NEMU to guest physical address in the guest program */
-paddr_t host_to_guest(uint8_t *haddr);
+static inline paddr_t host_to_guest(uint8_t *haddr) { return haddr - pmem + CONFIG_MBASE; }
 
 static inline bool in_pmem(paddr_t addr) {
   return addr - CONFIG_MBASE < CONFIG_MSIZE;
 }
 
+#ifdef CONFIG_MEM_RANDOM
+// pmem is filled with this byte before the guest writes to it
+extern uint8_t pmem_random_byte;
+#endif
+
+/* Fault in [addr, addr + len) of pmem. Call it before the host kernel
+ * writes to pmem (e.g. by read(2)), which fails with EFAULT on a page
+ * not touched yet rather than delivering the fault to NEMU.
+ */
+void pmem_populate(paddr_t addr, size_t len);
+
+/* Fill [addr, addr + len) of pmem with the bytes at offset `off` of the
+ * file `fd`, or with zeros if `fd` is -1. With PMEM_MMAP, the granules
+ * of pmem inside the range are mapped from the file copy-on-write, or
+ * as fresh anonymous pages, instead of copied, if the file offset is
+ * aligned to the page as the address is.
+ */
+void pmem_load(int fd, size_t off, paddr_t addr, size_t len);
+
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
 
+#ifdef CONFIG_DECODE_CACHE
+/* Guest code in pmem cached by the CPU is tracked in chunks. Bit i of
+ * pmem_code_map[p] is set if the i-th chunk of page p holds cached code,
+ * and writing to the chunk calls cpu_invalidate_code() on it. With
+ * PMEM_WINDOW, the map covers the whole physical space, so that it can
+ * be looked up before the bound of pmem is known to hold.
+ */
+#define CODE_CHUNK_SHIFT 6
+#define CODE_CHUNK_SIZE  (1u << CODE_CHUNK_SHIFT)
+extern uint64_t pmem_code_map[];
+void pmem_mark_code(paddr_t addr, int len);
+void pmem_invalidate_code(paddr_t addr, int len);
+
+static inline bool pmem_has_code(paddr_t addr) {
+  return pmem_code_map[(addr - CONFIG_MBASE) >> PAGE_SHIFT] != 0;
+}
+
+static inline bool pmem_is_code(paddr_t addr) {
+  return (pmem_code_map[(addr - CONFIG_MBASE) >> PAGE_SHIFT] >> ((addr & PAGE_MASK) >> CODE_CHUNK_SHIFT)) & 1;
+}
+#endif
+
+#ifdef CONFIG_PMEM_DIRTY
+/* pmem_dirty_map[p] is set to 1 by every store to page p of pmem. A
+ * consumer registered by pmem_dirty_register() gets from
+ * pmem_dirty_fetch() the pages written since its own last fetch,
+ * independently of other consumers. With PMEM_WINDOW, the map covers the
+ * whole physical space like pmem_code_map.
+ */
+extern uint8_t pmem_dirty_map[];
+int pmem_dirty_register();
+void pmem_dirty_fetch(int id, void (*fn)(paddr_t page, void *arg), void *arg);
+
+static inline void pmem_mark_dirty(paddr_t addr) {
+  pmem_dirty_map[(addr - CONFIG_MBASE) >> PAGE_SHIFT] = 1;
+}
+#else
+static inline void pmem_mark_dirty(paddr_t addr) {}
+#endif
+
+#ifdef CONFIG_PMEM_SNAPSHOT
+void pmem_snapshot(paddr_t addr, size_t len);
+void pmem_restore();
+#endif
+
+/* Whether a store of `len` bytes to pmem at `addr` can be done by the
+ * accessors below. Misaligned stores, which may cross pages and chunks of
+ * code, take paddr_write(), so only one page and chunk is checked.
+ */
+static inline bool pmem_write_fast(paddr_t addr, int len) {
+#if defined(CONFIG_DECODE_CACHE) || defined(CONFIG_PMEM_DIRTY)
+  return (addr & (len - 1)) == 0 && !MUXDEF(CONFIG_DECODE_CACHE, pmem_is_code(addr), false);
+#else
+  return true;
+#endif
+}
+
+/* Accessors with the width fixed at compile time. An access falling in
+ * pmem or in the passive MMIO map accessed last is a single load or store
+ * of the host type, anything else (MMIO, stores refused by
+ * pmem_write_fast(), out of bound) takes paddr_read()/paddr_write().
+ */
+#ifdef CONFIG_PMEM_WINDOW
+/* The whole guest physical space is reserved at pmem_window, and pmem is
+ * mapped at pmem_window + CONFIG_MBASE. The accessors below touch the
+ * window with the host address in rdx and the data in rax, and record
+ * the instruction in the section pmem_extable, so that the SIGSEGV
+ * handler can emulate a faulting access with paddr_read()/paddr_write()
+ * and resume after the instruction.
+ */
+extern uint8_t *pmem_window;
+
+typedef struct {
+  uintptr_t insn, next;
+  uint32_t len, is_write;
+} PmemExtable;
+
+bool pmem_window_fault(void *ucontext);
+
+#define PMEM_EXTABLE_ENTRY \
+  ".pushsection pmem_extable, \"aw\"\n" \
+  ".balign 8\n" \
+  ".quad 1b, 2b\n" \
+  ".long %c[len], %c[is_write]\n" \
+  ".popsection\n"
+#define __PMEM_LD_8  "movzbl (%[ptr]), %k[data]"
+#define __PMEM_LD_16 "movzwl (%[ptr]), %k[data]"
+#define __PMEM_LD_32 "movl (%[ptr]), %k[data]"
+#define __PMEM_ST_8  "movb %b[data], (%[ptr])"
+#define __PMEM_ST_16 "movw %w[data], (%[ptr])"
+#define __PMEM_ST_32 "movl %k[data], (%[ptr])"
+
+#define def_paddr_access(bits) \
+static inline word_t concat(paddr_read, bits)(paddr_t addr) { \
+  concat3(uint, bits, _t) *ptr = (void *)(pmem_window + addr); \
+  uint32_t data; \
+  asm volatile ("1: " concat(__PMEM_LD_, bits) "\n2:\n" PMEM_EXTABLE_ENTRY \
+      : [data] "=a" (data) \
+      : [ptr] "d" (ptr), "m" (*ptr), [len] "i" (bits / 8), [is_write] "i" (0)); \
+  return data; \
+} \
+static inline void concat(paddr_write, bits)(paddr_t addr, word_t data) { \
+  if (unlikely(!pmem_write_fast(addr, bits / 8))) { \
+    paddr_write(addr, bits / 8, data); \
+    return; \
+  } \
+  concat3(uint, bits, _t) *ptr = (void *)(pmem_window + addr); \
+  pmem_mark_dirty(addr); \
+  asm volatile ("1: " concat(__PMEM_ST_, bits) "\n2:\n" PMEM_EXTABLE_ENTRY \
+      : "=m" (*ptr) \
+      : [ptr] "d" (ptr), [data] "a" (data), [len] "i" (bits / 8), [is_write] "i" (1)); \
+}
+#else
+#define def_paddr_access(bits) \
+static inline word_t concat(paddr_read, bits)(paddr_t addr) { \
+  if (likely(in_pmem(addr))) return *(concat3(uint, bits, _t) *)guest_to_host(addr); \
+  uint8_t *p = mmio_passive_host(addr, bits / 8, false); \
+  if (p != NULL) return *(concat3(uint, bits, _t) *)p; \
+  return paddr_read(addr, bits / 8); \
+} \
+static inline void concat(paddr_write, bits)(paddr_t addr, word_t data) { \
+  if (likely(in_pmem(addr) && pmem_write_fast(addr, bits / 8))) { \
+    *(concat3(uint, bits, _t) *)guest_to_host(addr) = data; \
+    pmem_mark_dirty(addr); \
+    return; \
+  } \
+  uint8_t *p = mmio_passive_host(addr, bits / 8, true); \
+  if (p != NULL) { *(concat3(uint, bits, _t) *)p = data; return; } \
+  paddr_write(addr, bits / 8, data); \
+}
+#endif
+
+def_paddr_access(8)
+def_paddr_access(16)
+def_paddr_access(32)
+IFDEF(CONFIG_ISA64, def_paddr_access(64))
+
 #endif
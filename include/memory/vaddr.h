@@ -17,13 +17,77 @@
 #define __MEMORY_VADDR_H__
 
 #include <common.h>
+#include <isa.h>
+#include <memory/host.h>
+#include <memory/paddr.h>
 
-word_t vaddr_ifetch(vaddr_t addr, int len);
 word_t vaddr_read(vaddr_t addr, int len);
 void vaddr_write(vaddr_t addr, int len, word_t data);
 
-#define PAGE_SHIFT        12
-#define PAGE_SIZE         (1ul << PAGE_SHIFT)
-#define PAGE_MASK         (PAGE_SIZE - 1)
+/* The page instructions are currently fetched from: `tag` is its virtual
+ * page and `host` the host address of its physical page. It only caches
+ * pages in pmem, whose contents are read through `host`, so stores to the
+ * code need not drop it. Changes of the translation must, by vaddr_flush().
+ */
+typedef struct {
+  vaddr_t tag;
+  uint8_t *host;
+} IFetchPage;
+
+extern IFetchPage ifetch_page;
+word_t vaddr_ifetch_slow(vaddr_t addr, int len);
+void ifetch_flush();
+
+#ifdef CONFIG_SOFT_TLB
+// hits and misses of the TLBs, indexed by MEM_TYPE_*
+extern uint64_t g_tlb_hit[3], g_tlb_miss[3];
+void tlb_flush();
+void tlb_flush_paddr(paddr_t addr);
+#else
+// the fetch page still caches a translation without the TLBs
+static inline void tlb_flush() { ifetch_flush(); }
+static inline void tlb_flush_paddr(paddr_t addr) {}
+#endif
+
+// call when the translation changes, e.g. on writes to satp and sfence.vma
+void vaddr_flush();
+
+// let writes to the physical memory the code at `addr` was fetched from invalidate it
+void vaddr_mark_code(vaddr_t addr, int len);
+
+// fetches within the cached page are a single load
+static inline word_t vaddr_ifetch(vaddr_t addr, int len) {
+  vaddr_t off = addr & PAGE_MASK;
+  if (likely((addr & ~PAGE_MASK) == ifetch_page.tag && off + len <= PAGE_SIZE)) {
+    return host_read(ifetch_page.host + off, len);
+  }
+  return vaddr_ifetch_slow(addr, len);
+}
+
+/* Accessors with the width fixed at compile time. Untranslated accesses
+ * go straight to the paddr accessor of the same width.
+ */
+#define def_vaddr_access(bits) \
+static inline word_t concat(vaddr_read, bits)(vaddr_t addr) { \
+  if (isa_mmu_check(addr, bits / 8, MEM_TYPE_READ) == MMU_DIRECT) return concat(paddr_read, bits)(addr); \
+  return vaddr_read(addr, bits / 8); \
+} \
+static inline void concat(vaddr_write, bits)(vaddr_t addr, word_t data) { \
+  if (isa_mmu_check(addr, bits / 8, MEM_TYPE_WRITE) == MMU_DIRECT) { concat(paddr_write, bits)(addr, data); return; } \
+  vaddr_write(addr, bits / 8, data); \
+}
+
+def_vaddr_access(8)
+def_vaddr_access(16)
+def_vaddr_access(32)
+IFDEF(CONFIG_ISA64, def_vaddr_access(64))
+
+// pick the accessor by `len`, which must be a literal 1, 2, 4 or 8
+#define __VADDR_BITS_1 8
+#define __VADDR_BITS_2 16
+#define __VADDR_BITS_4 32
+#define __VADDR_BITS_8 64
+#define VADDR_READ(addr, len)        concat(vaddr_read, concat(__VADDR_BITS_, len))(addr)
+#define VADDR_WRITE(addr, len, data) concat(vaddr_write, concat(__VADDR_BITS_, len))(addr, data)
 
 #endif
@@ -34,6 +34,14 @@ extern NEMUState nemu_state;
 
 uint64_t get_time();
 
+// ----------- symbol -----------
+
+/* Look up the function or object of the loaded ELF holding `addr`.
+ * Return its name, and its start address in `start` if not NULL, or
+ * NULL if there is none.
+ */
+const char *elf_symbol(vaddr_t addr, vaddr_t *start);
+
 // ----------- log -----------
 
 #define ANSI_FG_BLACK   "\33[1;30m"
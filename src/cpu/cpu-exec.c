@@ -16,7 +16,18 @@
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <memory/vaddr.h>
 #include <locale.h>
+#include <stdatomic.h>
+#ifdef CONFIG_BLOCK_CACHE
+#include <block.h>
+#endif
+#ifdef CONFIG_ENGINE_JIT
+#include <jit.h>
+#endif
+#ifdef CONFIG_DEVICE
+#include <device/event.h>
+#endif
 
 /* The assembly code of instructions executed is only output to the screen
  * when the number of instructions executed is less than this value.
@@ -30,7 +41,26 @@ uint64_t g_nr_guest_inst = 0;
 static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
 
-void device_update();
+void instpat_profile_dump();
+
+void device_attend();
+
+/* Devices are not updated after every instruction, but between quanta of
+ * instructions. A quantum runs up to the next deadline of the events of
+ * devices, and cpu_request_attention() ends it early. Only the render
+ * thread asks for attention, so the flag is only checked with it.
+ */
+static atomic_bool g_attention = false;
+
+// may be called by any thread
+void cpu_request_attention() {
+  atomic_store_explicit(&g_attention, true, memory_order_relaxed);
+}
+
+static inline bool quantum_over() {
+  return nemu_state.state != NEMU_RUNNING ||
+    MUXDEF(CONFIG_VGA_RENDER_THREAD, atomic_load_explicit(&g_attention, memory_order_relaxed), false);
+}
 
 static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
 #ifdef CONFIG_ITRACE_COND
@@ -40,12 +70,9 @@ static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
   IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
 }
 
-static void exec_once(Decode *s, vaddr_t pc) {
-  s->pc = pc;
-  s->snpc = pc;
-  isa_exec_once(s);
-  cpu.pc = s->dnpc;
 #ifdef CONFIG_ITRACE
+// write the address, the bytes and the disassembly of the instruction at `s->pc` to `s->logbuf`
+static void itrace_fill(Decode *s) {
   char *p = s->logbuf;
   p += snprintf(p, sizeof(s->logbuf), FMT_WORD ":", s->pc);
   int ilen = s->snpc - s->pc;
@@ -68,20 +95,189 @@ static void exec_once(Decode *s, vaddr_t pc) {
 #else
   p[0] = '\0'; // the upstream llvm does not support loongarch32r
 #endif
+}
+#endif
+
+static void exec_once(Decode *s, vaddr_t pc) {
+  s->pc = pc;
+  s->snpc = pc;
+  IFDEF(CONFIG_DECODE_CACHE, dcache_lookup(s));
+  isa_exec_once(s);
+  cpu.pc = s->dnpc;
+  IFDEF(CONFIG_ITRACE, itrace_fill(s));
+}
+
+#ifdef CONFIG_BLOCK_CACHE
+IFDEF(CONFIG_THREADED_DISPATCH, DecodeCacheEntry *g_thread_end = NULL);
+
+#ifdef CONFIG_DECODE_FUSION
+// executions of each idiom with a single handler, and one by one
+static uint64_t g_fuse_hit[FUSE_MAX_IDIOM] = {}, g_fuse_miss[FUSE_MAX_IDIOM] = {};
+
+// check whether the last two instructions recorded in `b` form an idiom
+static void fuse_last_pair(Block *b) {
+  b->fuse[b->n - 1] = 0;
+  if (b->n < 2) return;
+  int idiom = isa_fuse(&b->inst[b->n - 2]);
+  b->fuse[b->n - 2] = idiom;
+  if (idiom != 0) g_fuse_miss[idiom] ++; // the pair has just been executed one by one
+}
+
+/* If instruction `i` of `b` starts a fused pair and the whole pair fits
+ * in the budget `n`, execute the pair and return true.
+ */
+static inline bool exec_fused(Decode *s, Block *b, uint64_t i, uint64_t n) {
+  int idiom = b->fuse[i];
+  if (likely(idiom == 0)) return false;
+  if (n - i < 2) { g_fuse_miss[idiom] ++; return false; }
+  isa_exec_fused(s, idiom);
+  g_fuse_hit[idiom] ++;
+  return true;
+}
+#endif
+
+/* Execute at most `n` instructions of the block starting at `cpu.pc`,
+ * and return the number of instructions executed. A block missing in the
+ * block cache is recorded while it is executed by exec_once(). It ends at
+ * the first instruction which does not fall through to the next one.
+ * Pairs of instructions fused while recording are executed together when
+ * the block is hit.
+ */
+static uint64_t exec_block(Decode *s, uint64_t n) {
+  Block *b = block_lookup(cpu.pc);
+  bool hit = block_hit(b, cpu.pc);
+  if (!hit) block_reset(b, cpu.pc);
+
+  uint64_t i = 0;
+  bool stop = false;
+  while (i < n) {
+    if (hit) {
+      s->pc = cpu.pc;
+      dcache_use(s, &b->inst[i]);
+#ifdef CONFIG_THREADED_DISPATCH
+      // run the rest of the block within the budget in one call
+      g_thread_end = &b->inst[b->n < n ? b->n : n];
+      isa_exec_once(s);
+      g_thread_end = NULL;
+      i = s->dc - b->inst; // the last one run
+#else
+      if (MUXDEF(CONFIG_DECODE_FUSION, exec_fused(s, b, i, n), false)) i ++; // the first one of the pair
+      else isa_exec_once(s);
 #endif
+      cpu.pc = s->dnpc;
+      IFDEF(CONFIG_ITRACE, itrace_fill(s));
+    } else {
+      exec_once(s, cpu.pc);
+      DecodeCacheEntry *e = dcache_entry(s->pc);
+      if (likely(e->handler != NULL)) {
+        b->inst[b->n ++] = *e;
+        IFDEF(CONFIG_DECODE_FUSION, fuse_last_pair(b));
+      } else stop = true; // the instruction has overwritten itself
+    }
+    i ++;
+    trace_and_difftest(s, cpu.pc);
+    if (nemu_state.state != NEMU_RUNNING) break;
+    if (hit) {
+      // leave the block if a branch inside it goes elsewhere this time,
+      // or if the block is invalidated by a write to its code
+      if (i >= b->n || b->inst[i].pc != cpu.pc) break;
+    } else if (stop || cpu.pc != s->snpc || b->n == BLOCK_MAX_INST) break;
+  }
+  return i;
+}
+
+// execute a quantum of at most `n` instructions, and return the number of them
+static uint64_t exec_quantum(Decode *s, uint64_t n) {
+  uint64_t i = 0;
+  while (i < n) {
+    uint64_t nr_inst = MUXDEF(CONFIG_ENGINE_JIT, jit_exec(n - i), 0);
+    if (nr_inst == 0) nr_inst = exec_block(s, n - i);
+    g_nr_guest_inst += nr_inst;
+    i += nr_inst;
+    if (quantum_over()) break;
+  }
+  return i;
+}
+#else
+static uint64_t exec_quantum(Decode *s, uint64_t n) {
+  uint64_t i = 0;
+  while (i < n) {
+    exec_once(s, cpu.pc);
+    g_nr_guest_inst ++;
+    i ++;
+    trace_and_difftest(s, cpu.pc);
+    if (quantum_over()) break;
+  }
+  return i;
 }
+#endif
 
 static void execute(uint64_t n) {
   Decode s;
-  for (;n > 0; n --) {
-    exec_once(&s, cpu.pc);
-    g_nr_guest_inst ++;
-    trace_and_difftest(&s, cpu.pc);
+  IFDEF(CONFIG_DEVICE, event_start());
+  while (n > 0) {
+#ifdef CONFIG_DEVICE
+    uint64_t left = (event_next > g_nr_guest_inst ? event_next - g_nr_guest_inst : 0);
+    uint64_t nr_inst = exec_quantum(&s, (n < left ? n : left));
+#else
+    uint64_t nr_inst = exec_quantum(&s, n);
+#endif
+    n -= nr_inst;
     if (nemu_state.state != NEMU_RUNNING) break;
-    IFDEF(CONFIG_DEVICE, device_update());
+#ifdef CONFIG_DEVICE
+    if (atomic_exchange_explicit(&g_attention, false, memory_order_relaxed)) device_attend();
+    event_run();
+#endif
   }
 }
 
+#ifdef CONFIG_DECODE_CACHE
+// called by paddr_write() when guest code cached here is overwritten
+void cpu_invalidate_code(vaddr_t addr, int len) {
+  // the code is cached by virtual pc, which is not `addr` under translation
+  if (isa_mmu_check(cpu.pc, 4, MEM_TYPE_IFETCH) != MMU_DIRECT) { cpu_flush_code(); return; }
+  dcache_invalidate(addr, len);
+#ifdef CONFIG_BLOCK_CACHE
+  int i;
+  for (i = 0; i < BLOCK_NR_ENTRY; i ++) block_invalidate(&bcache[i], addr, len);
+  IFDEF(CONFIG_THREADED_DISPATCH, g_thread_end = NULL); // stop at the current instruction
+#endif
+  IFDEF(CONFIG_ENGINE_JIT, jit_invalidate(addr, len));
+}
+
+// called by vaddr_flush() when the translation changes
+void cpu_flush_code() {
+  dcache_flush();
+#ifdef CONFIG_BLOCK_CACHE
+  int i;
+  for (i = 0; i < BLOCK_NR_ENTRY; i ++) {
+    bcache[i].pc = (vaddr_t)-1;
+    bcache[i].n = 0;
+  }
+  IFDEF(CONFIG_THREADED_DISPATCH, g_thread_end = NULL);
+#endif
+  IFDEF(CONFIG_ENGINE_JIT, jit_flush());
+}
+#endif
+
+#ifdef CONFIG_PMEM_SNAPSHOT
+/* Bring the guest back to the state right after the image is loaded, so
+ * that it can run again without restarting NEMU. Devices are not reset.
+ */
+void cpu_reset() {
+  pmem_restore();
+  // start from empty caches, as a new process does
+  IFDEF(CONFIG_DECODE_CACHE, cpu_flush_code());
+  isa_reset();
+  IFDEF(CONFIG_ENGINE_JIT, jit_reset());
+  IFDEF(CONFIG_DIFFTEST, ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF));
+  nemu_state = (NEMUState) { .state = NEMU_STOP };
+  IFDEF(CONFIG_DEVICE, event_rebase(g_nr_guest_inst));
+  g_nr_guest_inst = 0;
+  g_timer = 0;
+}
+#endif
+
 static void statistic() {
   IFNDEF(CONFIG_TARGET_AM, setlocale(LC_NUMERIC, ""));
 #define NUMBERIC_FMT MUXDEF(CONFIG_TARGET_AM, "%", "%'") PRIu64
@@ -89,6 +285,36 @@ static void statistic() {
   Log("total guest instructions = " NUMBERIC_FMT, g_nr_guest_inst);
   if (g_timer > 0) Log("simulation frequency = " NUMBERIC_FMT " inst/s", g_nr_guest_inst * 1000000 / g_timer);
   else Log("Finish running in less than 1 us and can not calculate the simulation frequency");
+#ifdef CONFIG_DECODE_CACHE
+  uint64_t nr_lookup = g_dcache_hit + g_dcache_miss;
+  if (nr_lookup > 0) {
+    uint64_t rate = g_dcache_hit * 10000 / nr_lookup;
+    Log("decode cache hit rate = %" PRIu64 ".%02" PRIu64 "%% (" NUMBERIC_FMT " hits, " NUMBERIC_FMT " misses)",
+        rate / 100, rate % 100, g_dcache_hit, g_dcache_miss);
+  }
+#endif
+#ifdef CONFIG_SOFT_TLB
+  const char *tlb_name[] = { "ifetch", "read", "write" }; // indexed by MEM_TYPE_*
+  int t;
+  for (t = 0; t < 3; t ++) {
+    uint64_t nr_access = g_tlb_hit[t] + g_tlb_miss[t];
+    if (nr_access == 0) continue;
+    uint64_t rate = g_tlb_hit[t] * 10000 / nr_access;
+    Log("%s TLB hit rate = %" PRIu64 ".%02" PRIu64 "%% (" NUMBERIC_FMT " hits, " NUMBERIC_FMT " misses)",
+        tlb_name[t], rate / 100, rate % 100, g_tlb_hit[t], g_tlb_miss[t]);
+  }
+#endif
+#ifdef CONFIG_DECODE_FUSION
+  int k;
+  for (k = 1; k < FUSE_MAX_IDIOM; k ++) {
+    uint64_t nr_exec = g_fuse_hit[k] + g_fuse_miss[k];
+    if (nr_exec == 0) continue;
+    uint64_t rate = g_fuse_hit[k] * 10000 / nr_exec;
+    Log("fusion of %s: hit rate = %" PRIu64 ".%02" PRIu64 "%% (" NUMBERIC_FMT " fused, " NUMBERIC_FMT " split)",
+        isa_fuse_name(k), rate / 100, rate % 100, g_fuse_hit[k], g_fuse_miss[k]);
+  }
+#endif
+  IFDEF(CONFIG_DECODE_PROFILE, instpat_profile_dump());
 }
 
 void assert_fail_msg() {
@@ -101,7 +327,8 @@ void cpu_exec(uint64_t n) {
   g_print_step = (n < MAX_INST_TO_PRINT);
   switch (nemu_state.state) {
     case NEMU_END: case NEMU_ABORT:
-      printf("Program execution has ended. To restart the program, exit NEMU and run again.\n");
+      printf("Program execution has ended. To restart the program, %s.\n",
+          MUXDEF(CONFIG_PMEM_SNAPSHOT, "reset it", "exit NEMU and run again"));
       return;
     default: nemu_state.state = NEMU_RUNNING;
   }
@@ -0,0 +1,38 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/decode.h>
+
+#ifdef CONFIG_DECODE_CACHE
+DecodeCacheEntry dcache[DCACHE_NR_ENTRY] = {};
+uint64_t g_dcache_hit = 0, g_dcache_miss = 0;
+
+/* Drop the instructions overlapping [addr, addr + len), including those
+ * starting up to ISA_MAX_ILEN - 1 bytes before it. Entries are indexed by
+ * pc / 4, so one pc every 4 bytes visits all the entries which may hold them.
+ */
+void dcache_invalidate(vaddr_t addr, int len) {
+  vaddr_t pc;
+  for (pc = (addr - (ISA_MAX_ILEN - 1)) & ~(vaddr_t)3; pc < addr + len; pc += 4) {
+    DecodeCacheEntry *e = dcache_entry(pc);
+    if (e->pc < addr + len && e->pc + e->ilen > addr) e->handler = NULL;
+  }
+}
+
+void dcache_flush() {
+  int i;
+  for (i = 0; i < DCACHE_NR_ENTRY; i ++) dcache[i].handler = NULL;
+}
+#endif
@@ -0,0 +1,58 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/decode.h>
+
+#ifdef CONFIG_DECODE_PROFILE
+static InstpatCounter *head = NULL;
+static int nr_counter = 0;
+static const char *profile_file = NULL;
+
+void init_instpat_profile(const char *file) {
+  profile_file = file;
+  if (file == NULL) Log("INSTPAT() profile is not written since --profile is not given");
+}
+
+void instpat_profile_add(InstpatCounter *c) {
+  c->next = head;
+  head = c;
+  nr_counter ++;
+}
+
+static int cmp_count(const void *a, const void *b) {
+  uint64_t x = (*(InstpatCounter **)a)->count;
+  uint64_t y = (*(InstpatCounter **)b)->count;
+  return (x < y) - (x > y);
+}
+
+// write the counts in the order of decreasing count, one pattern per line
+void instpat_profile_dump() {
+  if (profile_file == NULL) return;
+  FILE *fp = fopen(profile_file, "w");
+  Assert(fp, "Can not open '%s'", profile_file);
+  InstpatCounter **list = malloc(sizeof(*list) * nr_counter);
+  assert(list);
+  InstpatCounter *c;
+  int i = 0;
+  for (c = head; c != NULL; c = c->next) list[i ++] = c;
+  qsort(list, nr_counter, sizeof(*list), cmp_count);
+  for (i = 0; i < nr_counter; i ++) {
+    fprintf(fp, "%" PRIu64 " \"%s\"\n", list[i]->count, list[i]->pattern);
+  }
+  free(list);
+  fclose(fp);
+  Log("INSTPAT() profile of %d patterns is written to %s", nr_counter, profile_file);
+}
+#endif
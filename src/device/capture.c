@@ -0,0 +1,208 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <device/capture.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/* Headless capture of the screen. At each sync of the VGA, a hash of
+ * vmem is appended to DIR/frames.log, and some frames are written to
+ * DIR as PNG files by a writer thread. A frame is written if its number
+ * is a multiple of --capture-every, or if its hash differs from the one
+ * at the same line of the log given by --capture-golden.
+ */
+
+#define NR_SLOT 8
+
+static const char *capture_dir = NULL;
+static int capture_every = 0;
+static const char *golden_file = NULL;
+
+static FILE *log_fp = NULL, *golden_fp = NULL;
+static int width = 0, height = 0;
+static uint64_t nr_frame = 0, last_hash = 0;
+
+// frames waiting for the writer, which encodes slot `head` while it is queued
+typedef struct {
+  uint64_t no;
+  uint32_t *pixels;
+} Slot;
+
+static Slot slot[NR_SLOT] = {};
+static int head = 0, count = 0;
+static bool writer_stop = false;
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+void capture_set(const char *dir, int every, const char *golden) {
+  capture_dir = dir;
+  capture_every = every;
+  golden_file = golden;
+}
+
+/* Hash the frame in four independent lanes of 64-bit words, so that the
+ * multiplications overlap in the pipeline.
+ */
+static uint64_t frame_hash(const uint32_t *fb, size_t n) {
+  const uint64_t k = 0x9e3779b97f4a7c15ull;
+  const uint64_t *p = (const uint64_t *)fb;
+  size_t nr_word = n / 2, i;
+  uint64_t h0 = 1, h1 = 2, h2 = 3, h3 = 4;
+  for (i = 0; i + 4 <= nr_word; i += 4) {
+    h0 = (h0 ^ p[i + 0]) * k;
+    h1 = (h1 ^ p[i + 1]) * k;
+    h2 = (h2 ^ p[i + 2]) * k;
+    h3 = (h3 ^ p[i + 3]) * k;
+  }
+  for (; i < nr_word; i ++) h0 = (h0 ^ p[i]) * k;
+  if (n & 1) h1 = (h1 ^ fb[n - 1]) * k;
+  uint64_t h = h0;
+  h = (h ^ (h1 >> 7 | h1 << 57)) * k;
+  h = (h ^ (h2 >> 13 | h2 << 51)) * k;
+  h = (h ^ (h3 >> 29 | h3 << 35)) * k;
+  return h ^ (h >> 32);
+}
+
+static void png_chunk(FILE *fp, const char *type, const uint8_t *data, uint32_t len) {
+  uint8_t be[4] = { len >> 24, len >> 16, len >> 8, len };
+  fwrite(be, 4, 1, fp);
+  fwrite(type, 4, 1, fp);
+  if (len > 0) fwrite(data, len, 1, fp);
+  uint32_t crc = crc32(0, (const uint8_t *)type, 4);
+  if (len > 0) crc = crc32(crc, data, len); // crc32() returns 0 for NULL
+  uint8_t be_crc[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+  fwrite(be_crc, 4, 1, fp);
+}
+
+// Write the frame as an 8-bit RGB PNG, each row with no filter.
+static void write_png(const char *file, const uint32_t *pixels) {
+  size_t row = 1 + width * 3, raw_len = row * height;
+  uint8_t *raw = malloc(raw_len);
+  int x, y;
+  for (y = 0; y < height; y ++) {
+    uint8_t *q = raw + y * row;
+    *q ++ = 0;
+    for (x = 0; x < width; x ++) {
+      uint32_t c = pixels[y * width + x];
+      *q ++ = c >> 16; *q ++ = c >> 8; *q ++ = c;
+    }
+  }
+  uLongf z_len = compressBound(raw_len);
+  uint8_t *z = malloc(z_len);
+  Assert(compress2(z, &z_len, raw, raw_len, Z_BEST_SPEED) == Z_OK, "Can not compress %s", file);
+
+  FILE *fp = fopen(file, "wb");
+  Assert(fp, "Can not open '%s'", file);
+  static const uint8_t sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  fwrite(sig, 8, 1, fp);
+  uint8_t ihdr[13] = { width >> 24, width >> 16, width >> 8, width,
+    height >> 24, height >> 16, height >> 8, height, 8, 2, 0, 0, 0 };
+  png_chunk(fp, "IHDR", ihdr, 13);
+  png_chunk(fp, "IDAT", z, z_len);
+  png_chunk(fp, "IEND", NULL, 0);
+  fclose(fp);
+  free(z);
+  free(raw);
+}
+
+static void *writer_thread(void *arg) {
+  pthread_mutex_lock(&lock);
+  while (true) {
+    while (count == 0 && !writer_stop) pthread_cond_wait(&cond, &lock);
+    if (count == 0) break;
+    Slot *s = &slot[head];
+    pthread_mutex_unlock(&lock);
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/frame-%06" PRIu64 ".png", capture_dir, s->no);
+    write_png(file, s->pixels);
+    pthread_mutex_lock(&lock);
+    head = (head + 1) % NR_SLOT;
+    count --;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// Wait for the frames in the queue to be written.
+static void capture_exit() {
+  pthread_mutex_lock(&lock);
+  writer_stop = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(writer, NULL);
+  fclose(log_fp);
+}
+
+bool capture_init(int w, int h) {
+  if (capture_dir == NULL) return false;
+  width = w;
+  height = h;
+  Assert(mkdir(capture_dir, 0755) == 0 || errno == EEXIST,
+      "Can not create '%s'", capture_dir);
+  char file[PATH_MAX];
+  snprintf(file, sizeof(file), "%s/frames.log", capture_dir);
+  log_fp = fopen(file, "w");
+  Assert(log_fp, "Can not open '%s'", file);
+  if (golden_file != NULL) {
+    golden_fp = fopen(golden_file, "r");
+    Assert(golden_fp, "Can not open '%s'", golden_file);
+  }
+  int i;
+  for (i = 0; i < NR_SLOT; i ++) slot[i].pixels = malloc(w * h * sizeof(uint32_t));
+  Assert(pthread_create(&writer, NULL, writer_thread, NULL) == 0,
+      "failed to create the writer of frames");
+  atexit(capture_exit);
+  Log("Capture frames to %s", capture_dir);
+  return true;
+}
+
+// Return whether `hash` differs from the one of frame `no` in the golden log.
+static bool golden_mismatch(uint64_t no, uint64_t hash) {
+  if (golden_fp == NULL) return false;
+  uint64_t g_no, g_hash;
+  if (fscanf(golden_fp, "%" SCNu64 " %" SCNx64, &g_no, &g_hash) != 2) return true;
+  return g_no != no || g_hash != hash;
+}
+
+/* Record a sync of the screen. The hash is only computed again if vmem
+ * was written since the last sync.
+ */
+void capture_frame(const uint32_t *fb, bool dirty) {
+  uint64_t no = nr_frame ++;
+  if (dirty || no == 0) last_hash = frame_hash(fb, width * height);
+  fprintf(log_fp, "%06" PRIu64 " %016" PRIx64 "\n", no, last_hash);
+
+  bool dump = (capture_every > 0 && no % capture_every == 0);
+  if (golden_mismatch(no, last_hash)) dump = true;
+  if (!dump) return;
+
+  pthread_mutex_lock(&lock);
+  while (count == NR_SLOT) pthread_cond_wait(&cond, &lock);
+  Slot *s = &slot[(head + count) % NR_SLOT];
+  pthread_mutex_unlock(&lock);
+  // the writer does not touch the slot before it is counted
+  s->no = no;
+  memcpy(s->pixels, fb, width * height * sizeof(uint32_t));
+  pthread_mutex_lock(&lock);
+  count ++;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+}
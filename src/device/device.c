@@ -15,9 +15,11 @@
 
 #include <common.h>
 #include <utils.h>
-#include <device/alarm.h>
+#include <device/event.h>
+#include <cpu/cpu.h>
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
+#include <stdatomic.h>
 #endif
 
 void init_map();
@@ -28,27 +30,24 @@ void init_i8042();
 void init_audio();
 void init_disk();
 void init_sdcard();
-void init_alarm();
 
 void send_key(uint8_t, bool);
-void vga_update_screen();
-
-void device_update() {
-  static uint64_t last = 0;
-  uint64_t now = get_time();
-  if (now - last < 1000000 / TIMER_HZ) {
-    return;
-  }
-  last = now;
-
-  IFDEF(CONFIG_HAS_VGA, vga_update_screen());
 
 #ifndef CONFIG_TARGET_AM
+static atomic_bool quit_requested = false;
+
+/* Handle the pending events of SDL. This must run in the thread which
+ * created the window, that is the render thread with
+ * CONFIG_VGA_RENDER_THREAD, so closing the window only raises a flag for
+ * the CPU thread, and asks it to handle the flag at once.
+ */
+void sdl_handle_events() {
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
     switch (event.type) {
       case SDL_QUIT:
-        nemu_state.state = NEMU_QUIT;
+        atomic_store_explicit(&quit_requested, true, memory_order_relaxed);
+        IFDEF(CONFIG_VGA_RENDER_THREAD, cpu_request_attention());
         break;
 #ifdef CONFIG_HAS_KEYBOARD
       // If a key was pressed
@@ -63,13 +62,34 @@ void device_update() {
       default: break;
     }
   }
+}
+#endif
+
+// Called by the CPU between quanta when a device has asked for attention.
+void device_attend() {
+#ifndef CONFIG_TARGET_AM
+  if (atomic_exchange_explicit(&quit_requested, false, memory_order_relaxed)) {
+    nemu_state.state = NEMU_QUIT;
+  }
 #endif
 }
 
+// Poll the events of SDL at TIMER_HZ.
+static void device_update(Event *e) {
+#ifndef CONFIG_TARGET_AM
+  IFNDEF(CONFIG_VGA_RENDER_THREAD, sdl_handle_events());
+#endif
+  device_attend();
+  event_add_us(e, 1000000 / TIMER_HZ);
+}
+
+static Event update_event = EVENT_INIT("update", device_update);
+
+// Drop the events which came while the simple debugger was waiting.
 void sdl_clear_event_queue() {
 #ifndef CONFIG_TARGET_AM
-  SDL_Event event;
-  while (SDL_PollEvent(&event));
+  IFNDEF(CONFIG_VGA_RENDER_THREAD, sdl_handle_events());
+  atomic_store_explicit(&quit_requested, false, memory_order_relaxed);
 #endif
 }
 
@@ -85,5 +105,5 @@ void init_device() {
   IFDEF(CONFIG_HAS_DISK, init_disk());
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
 
-  IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  event_add_us(&update_event, 1000000 / TIMER_HZ);
 }
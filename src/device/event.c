@@ -0,0 +1,152 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/event.h>
+#include <utils.h>
+
+extern uint64_t g_nr_guest_inst;
+
+// the longest time to run without checking the host time
+#define EVENT_SLICE_MAX (1ull << 24)
+// the shortest host time to measure the speed of the guest over, in us
+#define RATE_WINDOW 10000
+
+uint64_t event_next = UINT64_MAX;
+
+// a binary min-heap of the scheduled events by deadline
+static Event **queue = NULL;
+static int nr_event = 0, max_event = 0;
+
+// guest instructions per ms of host time, measured since `base_*`
+static uint64_t rate = 10000;
+static uint64_t base_inst = 0, base_us = 0;
+
+// with --icount, an instruction takes 2^icount_shift ns of virtual time
+static int icount_shift = -1;
+
+static void queue_set(int i, Event *e) {
+  queue[i] = e;
+  e->idx = i;
+}
+
+static void sift_up(int i) {
+  Event *e = queue[i];
+  while (i > 0 && queue[(i - 1) / 2]->when > e->when) {
+    queue_set(i, queue[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  queue_set(i, e);
+}
+
+static void sift_down(int i) {
+  Event *e = queue[i];
+  while (2 * i + 1 < nr_event) {
+    int c = 2 * i + 1;
+    if (c + 1 < nr_event && queue[c + 1]->when < queue[c]->when) c ++;
+    if (queue[c]->when >= e->when) break;
+    queue_set(i, queue[c]);
+    i = c;
+  }
+  queue_set(i, e);
+}
+
+void event_del(Event *e) {
+  int i = e->idx;
+  if (i < 0) return;
+  e->idx = -1;
+  Event *last = queue[-- nr_event];
+  if (i < nr_event) {
+    queue_set(i, last);
+    sift_up(i);
+    sift_down(last->idx);
+  }
+  event_next = (nr_event > 0 ? queue[0]->when : UINT64_MAX);
+}
+
+static void schedule(Event *e, uint64_t when) {
+  event_del(e);
+  if (nr_event == max_event) {
+    max_event = (max_event == 0 ? 8 : max_event * 2);
+    queue = realloc(queue, max_event * sizeof(queue[0]));
+    assert(queue);
+  }
+  e->when = when;
+  queue_set(nr_event ++, e);
+  sift_up(nr_event - 1);
+  event_next = queue[0]->when;
+}
+
+void event_add(Event *e, uint64_t n) {
+  e->when_us = 0;
+  schedule(e, g_nr_guest_inst + n);
+}
+
+static uint64_t us_to_inst(uint64_t us) {
+  if (icount_shift >= 0) return (us * 1000 + (1ull << icount_shift) - 1) >> icount_shift;
+  uint64_t n = us * rate / 1000;
+  return (n == 0 ? 1 : (n > EVENT_SLICE_MAX ? EVENT_SLICE_MAX : n));
+}
+
+void event_set_icount(int shift) {
+  Assert(shift >= 0 && shift <= 20, "--icount=%d should be in [0, 20]", shift);
+  icount_shift = shift;
+  Log("Virtual time is derived from the instruction count, %d ns per instruction", 1 << shift);
+}
+
+uint64_t event_time() {
+  if (icount_shift >= 0) return (g_nr_guest_inst << icount_shift) / 1000;
+  return get_time();
+}
+
+void event_add_us(Event *e, uint64_t us) {
+  e->when_us = event_time() + us;
+  schedule(e, g_nr_guest_inst + us_to_inst(us));
+}
+
+void event_start() {
+  if (icount_shift >= 0) return;
+  base_inst = g_nr_guest_inst;
+  base_us = get_time();
+}
+
+void event_run() {
+  uint64_t now_us = event_time();
+  if (icount_shift < 0 && now_us - base_us >= RATE_WINDOW) {
+    rate = (g_nr_guest_inst - base_inst) * 1000 / (now_us - base_us);
+    if (rate == 0) rate = 1;
+    base_inst = g_nr_guest_inst;
+    base_us = now_us;
+  }
+
+  while (nr_event > 0 && queue[0]->when <= g_nr_guest_inst) {
+    Event *e = queue[0];
+    if (e->when_us > now_us) {
+      // the guest ran faster than estimated
+      schedule(e, g_nr_guest_inst + us_to_inst(e->when_us - now_us));
+      continue;
+    }
+    event_del(e);
+    e->handler(e);
+  }
+}
+
+void event_rebase(uint64_t n) {
+  int i;
+  for (i = 0; i < nr_event; i ++) {
+    queue[i]->when = (queue[i]->when > n ? queue[i]->when - n : 0);
+  }
+  base_inst = (base_inst > n ? base_inst - n : 0);
+  event_next = (nr_event > 0 ? queue[0]->when : UINT64_MAX);
+}
@@ -13,16 +13,32 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#define _GNU_SOURCE // for memfd_create()
 #include <isa.h>
 #include <memory/host.h>
 #include <memory/vaddr.h>
 #include <device/map.h>
+#ifdef CONFIG_PMEM_WINDOW
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #define IO_SPACE_MAX (2 * 1024 * 1024)
 
 static uint8_t *io_space = NULL;
 static uint8_t *p_space = NULL;
 
+#ifdef CONFIG_PMEM_WINDOW
+// the I/O space is shared memory, so that it can be mapped in the pmem window
+static int io_space_fd = -1;
+
+void map_alias(void *space, void *haddr, size_t len) {
+  void *p = mmap(haddr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+      io_space_fd, (uint8_t *)space - io_space);
+  Assert(p == haddr, "Can not map the I/O space at %p", haddr);
+}
+#endif
+
 uint8_t* new_space(int size) {
   uint8_t *p = p_space;
   // page aligned;
@@ -32,29 +48,27 @@ uint8_t* new_space(int size) {
   return p;
 }
 
-static void check_bound(IOMap *map, paddr_t addr) {
-  if (map == NULL) {
-    Assert(map != NULL, "address (" FMT_PADDR ") is out of bound at pc = " FMT_WORD, addr, cpu.pc);
-  } else {
-    Assert(addr <= map->high && addr >= map->low,
-        "address (" FMT_PADDR ") is out of bound {%s} [" FMT_PADDR ", " FMT_PADDR "] at pc = " FMT_WORD,
-        addr, map->name, map->low, map->high, cpu.pc);
-  }
-}
-
 static void invoke_callback(io_callback_t c, paddr_t offset, int len, bool is_write) {
   if (c != NULL) { c(offset, len, is_write); }
 }
 
 void init_map() {
+#ifdef CONFIG_PMEM_WINDOW
+  io_space_fd = memfd_create("nemu-io-space", 0);
+  assert(io_space_fd >= 0);
+  int ret = ftruncate(io_space_fd, IO_SPACE_MAX);
+  assert(ret == 0);
+  io_space = mmap(NULL, IO_SPACE_MAX, PROT_READ | PROT_WRITE, MAP_SHARED, io_space_fd, 0);
+  assert(io_space != MAP_FAILED);
+#else
   io_space = malloc(IO_SPACE_MAX);
   assert(io_space);
+#endif
   p_space = io_space;
 }
 
+// `map` is checked to cover `addr` by the bus, see mmio_read() and pio_read()
 word_t map_read(paddr_t addr, int len, IOMap *map) {
-  assert(len >= 1 && len <= 8);
-  check_bound(map, addr);
   paddr_t offset = addr - map->low;
   invoke_callback(map->callback, offset, len, false); // prepare data to read
   word_t ret = host_read(map->space + offset, len);
@@ -62,8 +76,6 @@ word_t map_read(paddr_t addr, int len, IOMap *map) {
 }
 
 void map_write(paddr_t addr, int len, word_t data, IOMap *map) {
-  assert(len >= 1 && len <= 8);
-  check_bound(map, addr);
   paddr_t offset = addr - map->low;
   host_write(map->space + offset, len, data);
   invoke_callback(map->callback, offset, len, true);
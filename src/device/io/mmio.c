@@ -13,17 +13,148 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#include <isa.h>
 #include <device/map.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+#ifdef CONFIG_PMEM_WINDOW
+#include <sys/mman.h>
+#endif
 
 #define NR_MAP 16
 
+// sorted by the address, so that the maps sharing a page are adjacent
 static IOMap maps[NR_MAP] = {};
 static int nr_map = 0;
 
+/* A two-level table from a physical page to the first map overlapping
+ * it. A page may be shared by several small maps, so the lookup goes on
+ * to the next maps until one starts beyond the address. Only the 32-bit
+ * physical space is covered.
+ */
+#define MMIO_PAGE_BITS (32 - PAGE_SHIFT)
+#define MMIO_L2_BITS   10
+#define MMIO_L1_SIZE   (1u << (MMIO_PAGE_BITS - MMIO_L2_BITS))
+#define MMIO_L2_SIZE   (1u << MMIO_L2_BITS)
+static IOMap **mmio_table[MMIO_L1_SIZE] = {};
+
+static inline IOMap** mmio_page(paddr_t addr) {
+  uint64_t page = (uint64_t)addr >> PAGE_SHIFT;
+  if (page >> MMIO_PAGE_BITS) return NULL;
+  IOMap **l2 = mmio_table[page >> MMIO_L2_BITS];
+  return l2 == NULL ? NULL : &l2[page & (MMIO_L2_SIZE - 1)];
+}
+
 static IOMap* fetch_mmio_map(paddr_t addr) {
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  return (mapid == -1 ? NULL : &maps[mapid]);
+  IOMap **entry = mmio_page(addr);
+  IOMap *map = (entry == NULL ? NULL : *entry);
+  for (; map != NULL && map < maps + nr_map && map->low <= addr; map ++) {
+    if (addr <= map->high) return map;
+  }
+  return NULL;
+}
+
+static void rebuild_mmio_table() {
+  int i;
+  for (i = 0; i < MMIO_L1_SIZE; i ++) {
+    if (mmio_table[i] != NULL) memset(mmio_table[i], 0, sizeof(IOMap *) * MMIO_L2_SIZE);
+  }
+  for (i = nr_map - 1; i >= 0; i --) {
+    uint64_t page;
+    for (page = maps[i].low >> PAGE_SHIFT; page <= maps[i].high >> PAGE_SHIFT; page ++) {
+      IOMap ***l2 = &mmio_table[page >> MMIO_L2_BITS];
+      if (*l2 == NULL) {
+        *l2 = calloc(MMIO_L2_SIZE, sizeof(IOMap *));
+        assert(*l2);
+      }
+      // the lowest map wins, since the maps are visited downwards
+      (*l2)[page & (MMIO_L2_SIZE - 1)] = &maps[i];
+    }
+  }
+}
+
+#ifndef CONFIG_DIFFTEST
+MMIOPassive mmio_passive = {};
+#endif
+
+#if defined(CONFIG_PMEM_WINDOW) && !defined(CONFIG_DIFFTEST)
+/* A page-aligned passive map is mapped again at its address in the pmem
+ * window, where each page is readable but not writable while it is
+ * clean. The first write to it faults, goes to mmio_write() and makes
+ * the page writable.
+ */
+static bool window_aliased(IOMap *map) {
+  return (map->low & PAGE_MASK) == 0 && ((uintptr_t)map->space & PAGE_MASK) == 0;
+}
+
+// set the protection of pages [l, r) of the map
+static void window_protect(IOMap *map, int l, int r, int prot) {
+  if (!window_aliased(map)) return;
+  int ret = mprotect(pmem_window + map->low + l * PAGE_SIZE, (r - l) * PAGE_SIZE, prot);
+  assert(ret == 0);
+}
+#endif
+
+static inline int map_nr_page(IOMap *map) {
+  return ((map->high - map->low) >> PAGE_SHIFT) + 1;
+}
+
+static void passive_access(IOMap *map, paddr_t addr, int len, bool is_write) {
+  if (is_write) {
+    int p;
+    for (p = (addr - map->low) >> PAGE_SHIFT; p <= (addr + len - 1 - map->low) >> PAGE_SHIFT; p ++) {
+      if (map->dirty[p]) continue;
+      map->dirty[p] = 1;
+      IFDEF(CONFIG_PMEM_WINDOW, IFNDEF(CONFIG_DIFFTEST, window_protect(map, p, p + 1, PROT_READ | PROT_WRITE)));
+    }
+  }
+  IFNDEF(CONFIG_DIFFTEST, mmio_passive = (MMIOPassive){ .low = map->low,
+      .size = map->high - map->low + 1, .space = map->space, .dirty = map->dirty });
+}
+
+/* Return the host address of the physical page `page` if it is covered
+ * by a passive map, for the TLB to access the page directly.
+ */
+uint8_t* mmio_passive_page(paddr_t page, bool is_write) {
+#ifndef CONFIG_DIFFTEST
+  IOMap *map = fetch_mmio_map(page);
+  if (map != NULL && map->passive && page + PAGE_SIZE - 1 <= map->high) {
+    passive_access(map, page, PAGE_SIZE, is_write);
+    return (uint8_t *)map->space + (page - map->low);
+  }
+#endif
+  return NULL;
+}
+
+/* Return whether the passive map of `space` is written since the last
+ * call. If `pages` is not NULL, also set pages[p] to whether page p of
+ * the space is.
+ */
+bool map_fetch_dirty(void *space, uint8_t *pages) {
+  int i;
+  for (i = 0; i < nr_map; i ++) {
+    IOMap *map = &maps[i];
+    if (map->space != space) continue;
+    assert(map->passive);
+    int n = map_nr_page(map), p, l = -1;
+    bool dirty = false;
+    for (p = 0; p <= n; p ++) {
+      bool d = (p < n && map->dirty[p]);
+      if (p < n && pages != NULL) pages[p] = d;
+      if (d) {
+        map->dirty[p] = 0;
+        dirty = true;
+        if (l < 0) l = p;
+      } else if (l >= 0) {
+        IFDEF(CONFIG_PMEM_WINDOW, IFNDEF(CONFIG_DIFFTEST, window_protect(map, l, p, PROT_READ)));
+        l = -1;
+      }
+    }
+    // let the next write through the TLB or the window mark it again
+    if (dirty) tlb_flush();
+    return dirty;
+  }
+  return false;
 }
 
 static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
@@ -32,32 +163,64 @@ static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
                "with %s@[" FMT_PADDR ", " FMT_PADDR "]", name1, l1, r1, name2, l2, r2);
 }
 
+static void report_mmio_out_of_bound(paddr_t addr) {
+  panic("address (" FMT_PADDR ") is out of bound at pc = " FMT_WORD, addr, cpu.pc);
+}
+
 /* device interface */
-void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_callback_t callback) {
+void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_callback_t callback, int flags) {
   assert(nr_map < NR_MAP);
   paddr_t left = addr, right = addr + len - 1;
+  Assert(len > 0 && left <= right && ((uint64_t)right >> PAGE_SHIFT >> MMIO_PAGE_BITS) == 0,
+      "MMIO region %s@[" FMT_PADDR ", " FMT_PADDR "] is out of the 32-bit physical space", name, left, right);
   if (in_pmem(left) || in_pmem(right)) {
     report_mmio_overlap(name, left, right, "pmem", PMEM_LEFT, PMEM_RIGHT);
   }
-  for (int i = 0; i < nr_map; i++) {
+  int i;
+  for (i = 0; i < nr_map; i++) {
     if (left <= maps[i].high && right >= maps[i].low) {
       report_mmio_overlap(name, left, right, maps[i].name, maps[i].low, maps[i].high);
     }
   }
 
-  maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
-    .space = space, .callback = callback };
-  Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
-      maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
+  // keep the maps sorted
+  for (i = nr_map; i > 0 && maps[i - 1].low > left; i --) maps[i] = maps[i - 1];
+  bool passive = (flags & MAP_PASSIVE) != 0;
+  Assert(!passive || callback == NULL, "passive MMIO region %s should have no callback", name);
+  maps[i] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
+    .space = space, .callback = callback, .passive = passive };
+  if (passive) {
+    maps[i].dirty = calloc(map_nr_page(&maps[i]), 1);
+    assert(maps[i].dirty);
+  }
+  Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]%s",
+      maps[i].name, maps[i].low, maps[i].high, passive ? " (passive)" : "");
 
   nr_map ++;
+  rebuild_mmio_table();
+  // the maps have moved
+  IFNDEF(CONFIG_DIFFTEST, mmio_passive = (MMIOPassive){});
+#if defined(CONFIG_PMEM_WINDOW) && !defined(CONFIG_DIFFTEST)
+  if (passive && window_aliased(&maps[i])) {
+    map_alias(space, pmem_window + addr, ROUNDUP(len, PAGE_SIZE));
+    window_protect(&maps[i], 0, map_nr_page(&maps[i]), PROT_READ);
+  }
+#endif
 }
 
 /* bus interface */
 word_t mmio_read(paddr_t addr, int len) {
-  return map_read(addr, len, fetch_mmio_map(addr));
+  IOMap *map = fetch_mmio_map(addr);
+  if (unlikely(map == NULL)) report_mmio_out_of_bound(addr);
+  difftest_skip_ref();
+  if (map->passive) passive_access(map, addr, len, false);
+  return map_read(addr, len, map);
 }
 
 void mmio_write(paddr_t addr, int len, word_t data) {
-  map_write(addr, len, data, fetch_mmio_map(addr));
+  IOMap *map = fetch_mmio_map(addr);
+  if (unlikely(map == NULL)) report_mmio_out_of_bound(addr);
+  difftest_skip_ref();
+  map_write(addr, len, data, map);
+  if (map->passive) passive_access(map, addr, len, true);
 }
@@ -15,6 +15,9 @@
 
 #include <common.h>
 #include <device/map.h>
+#include <device/event.h>
+#include <device/capture.h>
+#include <memory/paddr.h>
 
 #define SCREEN_W (MUXDEF(CONFIG_VGA_SIZE_800x600, 800, 400))
 #define SCREEN_H (MUXDEF(CONFIG_VGA_SIZE_800x600, 600, 300))
@@ -38,10 +41,15 @@ static uint32_t *vgactl_port_base = NULL;
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
 
+#define VGA_PITCH (SCREEN_W * sizeof(uint32_t))
+#define VMEM_PAGES ((SCREEN_W * SCREEN_H * sizeof(uint32_t) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+typedef struct { int y0, y1; } RowRange;
+
 static SDL_Renderer *renderer = NULL;
 static SDL_Texture *texture = NULL;
 
-static void init_screen() {
+static void init_sdl() {
   SDL_Window *window = NULL;
   char title[128];
   sprintf(title, "%s-NEMU", str(__GUEST_ISA__));
@@ -56,19 +64,155 @@ static void init_screen() {
   SDL_RenderPresent(renderer);
 }
 
-static inline void update_screen() {
-  SDL_UpdateTexture(texture, NULL, vmem, SCREEN_W * sizeof(uint32_t));
+// Upload the rows in each of the `n` ranges of `buf` and present.
+static void present(const void *buf, const RowRange *r, int n) {
+  int i;
+  for (i = 0; i < n; i ++) {
+    SDL_Rect rect = { .x = 0, .y = r[i].y0, .w = SCREEN_W, .h = r[i].y1 - r[i].y0 };
+    SDL_UpdateTexture(texture, &rect, (uint8_t *)buf + r[i].y0 * VGA_PITCH, VGA_PITCH);
+  }
   SDL_RenderClear(renderer);
   SDL_RenderCopy(renderer, texture, NULL, NULL);
   SDL_RenderPresent(renderer);
 }
+
+/* Fill `r` with the rows of vmem covered by each run of pages written
+ * since the last call, and return the number of ranges.
+ */
+static int fetch_dirty_rows(RowRange *r) {
+  static uint8_t vmem_dirty[VMEM_PAGES];
+  if (!map_fetch_dirty(vmem, vmem_dirty)) return 0;
+  int p, l = -1, n = 0;
+  for (p = 0; p <= VMEM_PAGES; p ++) {
+    if (p < VMEM_PAGES && vmem_dirty[p]) { if (l < 0) l = p; continue; }
+    if (l < 0) continue;
+    r[n].y0 = l * PAGE_SIZE / VGA_PITCH;
+    r[n].y1 = (p * PAGE_SIZE + VGA_PITCH - 1) / VGA_PITCH;
+    if (r[n].y1 > SCREEN_H) r[n].y1 = SCREEN_H;
+    n ++;
+    l = -1;
+  }
+  return n;
+}
+
+#ifdef CONFIG_VGA_RENDER_THREAD
+#include <pthread.h>
+#include <time.h>
+
+void sdl_handle_events();
+
+/* The CPU thread copies the dirty rows of vmem into `snapshot` at each
+ * sync, and the render thread moves them into `front` to upload them.
+ * Both only hold `frame_lock` while copying, so the CPU thread never
+ * waits for a present.
+ */
+static uint32_t snapshot[SCREEN_W * SCREEN_H] = {};
+static uint32_t front[SCREEN_W * SCREEN_H] = {};
+static uint8_t snapshot_dirty[SCREEN_H] = {};
+static bool frame_pending = false, sdl_ready = false;
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frame_cond = PTHREAD_COND_INITIALIZER;
+
+// Move the rows of `snapshot` written since the last call into `front`.
+static int take_frame(RowRange *r) {
+  int y, n = 0;
+  for (y = 0; y < SCREEN_H; y ++) {
+    if (!snapshot_dirty[y]) continue;
+    if (n > 0 && r[n - 1].y1 == y) r[n - 1].y1 ++;
+    else r[n ++] = (RowRange) { .y0 = y, .y1 = y + 1 };
+    snapshot_dirty[y] = 0;
+  }
+  int i;
+  for (i = 0; i < n; i ++) {
+    memcpy(front + r[i].y0 * SCREEN_W, snapshot + r[i].y0 * SCREEN_W,
+        (r[i].y1 - r[i].y0) * VGA_PITCH);
+  }
+  frame_pending = false;
+  return n;
+}
+
+/* Present the frames handed over by the CPU thread, and poll the events
+ * of SDL at TIMER_HZ while there is none.
+ */
+static void *render_thread(void *arg) {
+  init_sdl();
+  pthread_mutex_lock(&frame_lock);
+  sdl_ready = true;
+  pthread_cond_broadcast(&frame_cond);
+  while (true) {
+    if (!frame_pending) {
+      struct timespec t;
+      clock_gettime(CLOCK_REALTIME, &t);
+      t.tv_nsec += 1000000000 / TIMER_HZ;
+      if (t.tv_nsec >= 1000000000) { t.tv_sec ++; t.tv_nsec -= 1000000000; }
+      pthread_cond_timedwait(&frame_cond, &frame_lock, &t);
+    }
+    static RowRange r[SCREEN_H];
+    int n = (frame_pending ? take_frame(r) : 0);
+    pthread_mutex_unlock(&frame_lock);
+    if (n > 0) present(front, r, n);
+    sdl_handle_events();
+    pthread_mutex_lock(&frame_lock);
+  }
+  return NULL;
+}
+
+// SDL is initialized by the render thread, before the other devices use it.
+static void init_screen() {
+  pthread_t thread;
+  Assert(pthread_create(&thread, NULL, render_thread, NULL) == 0,
+      "failed to create the render thread");
+  pthread_detach(thread);
+  pthread_mutex_lock(&frame_lock);
+  while (!sdl_ready) pthread_cond_wait(&frame_cond, &frame_lock);
+  pthread_mutex_unlock(&frame_lock);
+}
+
+static inline void update_screen() {
+  static RowRange r[VMEM_PAGES];
+  int n = fetch_dirty_rows(r);
+  if (n == 0) return;
+  pthread_mutex_lock(&frame_lock);
+  int i;
+  for (i = 0; i < n; i ++) {
+    memcpy(snapshot + r[i].y0 * SCREEN_W, (uint32_t *)vmem + r[i].y0 * SCREEN_W,
+        (r[i].y1 - r[i].y0) * VGA_PITCH);
+    memset(snapshot_dirty + r[i].y0, 1, r[i].y1 - r[i].y0);
+  }
+  frame_pending = true;
+  pthread_cond_signal(&frame_cond);
+  pthread_mutex_unlock(&frame_lock);
+}
+#else
+static void init_screen() {
+  init_sdl();
+}
+
+// Upload the rows of vmem written since the last sync, if any, and present.
+static inline void update_screen() {
+  static RowRange r[VMEM_PAGES];
+  int n = fetch_dirty_rows(r);
+  if (n > 0) present(vmem, r, n);
+}
+#endif
 #else
 static void init_screen() {}
 
 static inline void update_screen() {
+  if (!map_fetch_dirty(vmem, NULL)) return;
   io_write(AM_GPU_FBDRAW, 0, 0, vmem, screen_width(), screen_height(), true);
 }
 #endif
+#elif defined(CONFIG_VGA_CAPTURE)
+static bool capture_on = false;
+
+static void init_screen() {
+  capture_on = capture_init(SCREEN_W, SCREEN_H);
+}
+
+static inline void update_screen() {
+  if (capture_on) capture_frame(vmem, map_fetch_dirty(vmem, NULL));
+}
 #endif
 
 void vga_update_screen() {
@@ -76,17 +220,27 @@ void vga_update_screen() {
   // then zero out the sync register
 }
 
+static void vga_refresh(Event *e) {
+  vga_update_screen();
+  event_add_us(e, 1000000 / TIMER_HZ);
+}
+
+static Event vga_event = EVENT_INIT("vga", vga_refresh);
+
 void init_vga() {
   vgactl_port_base = (uint32_t *)new_space(8);
   vgactl_port_base[0] = (screen_width() << 16) | screen_height();
 #ifdef CONFIG_HAS_PORT_IO
   add_pio_map ("vgactl", CONFIG_VGA_CTL_PORT, vgactl_port_base, 8, NULL);
 #else
-  add_mmio_map("vgactl", CONFIG_VGA_CTL_MMIO, vgactl_port_base, 8, NULL);
+  add_mmio_map("vgactl", CONFIG_VGA_CTL_MMIO, vgactl_port_base, 8, NULL, 0);
 #endif
 
   vmem = new_space(screen_size());
-  add_mmio_map("vmem", CONFIG_FB_ADDR, vmem, screen_size(), NULL);
-  IFDEF(CONFIG_VGA_SHOW_SCREEN, init_screen());
-  IFDEF(CONFIG_VGA_SHOW_SCREEN, memset(vmem, 0, screen_size()));
+  add_mmio_map("vmem", CONFIG_FB_ADDR, vmem, screen_size(), NULL, MAP_PASSIVE);
+#if defined(CONFIG_VGA_SHOW_SCREEN) || defined(CONFIG_VGA_CAPTURE)
+  init_screen();
+  memset(vmem, 0, screen_size());
+#endif
+  event_add_us(&vga_event, 1000000 / TIMER_HZ);
 }
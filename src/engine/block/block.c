@@ -13,12 +13,6 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
-#ifndef __DEVICE_ALARM_H__
-#define __DEVICE_ALARM_H__
+#include <block.h>
 
-#define TIMER_HZ 60
-
-typedef void (*alarm_handler_t) ();
-void add_alarm_handle(alarm_handler_t h);
-
-#endif
+Block bcache[BLOCK_NR_ENTRY] = {};
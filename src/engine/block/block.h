@@ -0,0 +1,67 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __BLOCK_H__
+#define __BLOCK_H__
+
+#include <cpu/decode.h>
+
+#define BLOCK_MAX_INST 64
+#define BLOCK_NR_ENTRY CONFIG_BLOCK_CACHE_SIZE
+static_assert((BLOCK_NR_ENTRY & (BLOCK_NR_ENTRY - 1)) == 0,
+    "the size of the block cache should be a power of 2");
+
+typedef struct {
+  vaddr_t pc;
+  int n; // number of instructions, 0 if the block is invalid
+  DecodeCacheEntry inst[BLOCK_MAX_INST];
+#ifdef CONFIG_DECODE_FUSION
+  uint8_t fuse[BLOCK_MAX_INST]; // idiom of the pair starting at inst[i], see isa_fuse()
+#endif
+#ifdef CONFIG_ENGINE_JIT
+  uint32_t nr_exec; // number of executions before translation
+  void *code;       // translated code, NULL if not translated yet
+#endif
+} Block;
+
+extern Block bcache[BLOCK_NR_ENTRY];
+
+static inline Block* block_lookup(vaddr_t pc) {
+  return &bcache[(pc >> 2) & (BLOCK_NR_ENTRY - 1)];
+}
+
+static inline bool block_hit(Block *b, vaddr_t pc) {
+  return b->pc == pc && b->n > 0;
+}
+
+// invalidate the block if it holds code in [addr, addr + len)
+static inline void block_invalidate(Block *b, vaddr_t addr, int len) {
+  if (b->n == 0) return;
+  vaddr_t end = b->inst[b->n - 1].pc + b->inst[b->n - 1].ilen;
+  if (addr < end && b->pc < addr + len) {
+    // also stop a block being recorded, `-1` is never the pc of an instruction
+    b->pc = (vaddr_t)-1;
+    b->n = 0;
+  }
+}
+
+// start recording a new block at `pc`
+static inline void block_reset(Block *b, vaddr_t pc) {
+  b->pc = pc;
+  b->n = 0;
+  IFDEF(CONFIG_ENGINE_JIT, b->nr_exec = 0; b->code = NULL);
+}
+
+#endif
@@ -15,3 +15,10 @@
 
 INC_PATH += $(NEMU_HOME)/src/engine/$(ENGINE)
 DIRS-y += src/engine/$(ENGINE)
+# the block engine shares the host calls and the monitor loop with the interpreter
+DIRS-$(CONFIG_ENGINE_BLOCK) += src/engine/interpreter
+# the JIT engine translates the blocks recorded by the block engine
+ifdef CONFIG_ENGINE_JIT
+INC_PATH += $(NEMU_HOME)/src/engine/block
+DIRS-y += src/engine/block src/engine/interpreter
+endif
@@ -0,0 +1,765 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <cpu/difftest.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <block.h>
+#include <jit.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#ifndef __x86_64__
+#error "the JIT engine only generates x86-64 code"
+#endif
+
+// a block is translated after being executed this many times
+#define JIT_HOT_THRESHOLD 16
+// upper bound of the size of the code translated from a block, including
+// the copy of its instructions
+#define JIT_BLOCK_CODE_MAX (BLOCK_MAX_INST * (256 + sizeof(DecodeCacheEntry)) + 64)
+// chained blocks return to execute() after at most this many instructions,
+// so that devices are still updated in time
+#define JIT_QUANTUM 4096
+#define JIT_MAX_TRANS 65536
+#define JIT_NR_CELL 16384
+#define IBTC_NR_ENTRY 1024
+#define RAS_NR_ENTRY 16
+// never matches a guest pc, since jalr clears the lowest bit
+#define PC_INVALID 1
+
+static uint8_t *code_cache = NULL;
+static uint8_t *code = NULL; // where the next byte is emitted
+static uint8_t *code_start = NULL; // where translated blocks start
+
+// translated blocks, which are reachable from the chains until flushed
+typedef struct {
+  vaddr_t start, end;
+  uint8_t *entry;
+} Trans;
+static Trans trans[JIT_MAX_TRANS];
+static int nr_trans = 0;
+
+// indirect-branch target cache, indexed by the guest target
+typedef struct {
+  vaddr_t pc;
+  void *entry;
+} IBTCEntry;
+static IBTCEntry ibtc[IBTC_NR_ENTRY];
+
+/* Return-address stack. A call pushes its return address with a cell,
+ * which holds the translated block at the return address once it is known.
+ */
+typedef struct {
+  vaddr_t pc;
+  void **cell;
+} RASEntry;
+static RASEntry ras[RAS_NR_ENTRY];
+static uint32_t ras_top = 0;
+static void *cells[JIT_NR_CELL];
+static int nr_cell = 0;
+
+static_assert(sizeof(IBTCEntry) == 16 && offsetof(IBTCEntry, entry) == 8, "layout used by translated code");
+static_assert(sizeof(RASEntry) == 16 && offsetof(RASEntry, cell) == 8, "layout used by translated code");
+
+// set when translated code is invalidated, cleared by jit_exec()
+static bool stale = false;
+// set by jit_flush(), the code cache is flushed by jit_exec() once no translated code runs
+static bool need_flush = false;
+
+/* An exit which is not chained yet records itself and its target here
+ * before returning to execute(), and it is chained by jit_exec() if the
+ * next block starts at the target.
+ */
+static uint8_t *pending_jmp = NULL;
+static void **pending_cell = NULL;
+static vaddr_t pending_pc = PC_INVALID;
+
+static uint64_t (*jit_enter)(uint64_t budget, void *entry) = NULL;
+static uint8_t *jit_leave = NULL;
+
+// --- x86-64 code emitter ---
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+enum { SH_SHL = 4, SH_SHR = 5, SH_SAR = 7 };
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_GE = 0xd };
+
+static void emit8(uint8_t b) { *code ++ = b; }
+static void emit32(uint32_t v) { memcpy(code, &v, 4); code += 4; }
+static void emit64(uint64_t v) { memcpy(code, &v, 8); code += 8; }
+static void emit_modrm(int mod, int reg, int rm) { emit8((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+
+// rbx points to `cpu` in the translated code
+#define GPR_OFF(i) (offsetof(CPU_state, gpr) + (i) * sizeof(word_t))
+#define PC_OFF     offsetof(CPU_state, pc)
+
+/* Guest registers are XLEN bits wide, so the instructions operating on
+ * them need REX.W on riscv64. The `_x` emitters below operate on guest
+ * registers, and the others on 32-bit values.
+ */
+#define REX_W() IFDEF(CONFIG_RV64, emit8(0x48))
+
+static void mov_r_cpu(int r, uint32_t off) { REX_W(); emit8(0x8b); emit_modrm(2, r, RBX); emit32(off); }
+static void mov_cpu_r(uint32_t off, int r) { REX_W(); emit8(0x89); emit_modrm(2, r, RBX); emit32(off); }
+static void mov_r_imm(int r, uint32_t imm) { emit8(0xb8 + r); emit32(imm); }
+static void mov_r_imm64(int r, uint64_t imm) { emit8(0x48); emit8(0xb8 + r); emit64(imm); }
+static void mov_r_word(int r, word_t v) {
+  if (v == (uint32_t)v) mov_r_imm(r, v);
+  else mov_r_imm64(r, v);
+}
+// clobber rcx if `v` does not fit in a sign-extended imm32
+static void mov_cpu_word(uint32_t off, word_t v) {
+  if (v == (word_t)SEXT(v, 32)) { REX_W(); emit8(0xc7); emit_modrm(2, 0, RBX); emit32(off); emit32(v); }
+  else { mov_r_imm64(RCX, v); mov_cpu_r(off, RCX); }
+}
+static void mov_r_r(int dst, int src) { emit8(0x89); emit_modrm(3, src, dst); }
+static void mov_x_r(int dst, int src) { REX_W(); mov_r_r(dst, src); }
+static void movsx_x_r(int len, int dst, int src) {
+  REX_W(); emit8(0x0f); emit8(len == 1 ? 0xbe : 0xbf); emit_modrm(3, dst, src);
+}
+static void movsxd_r_r(int dst, int src) { emit8(0x48); emit8(0x63); emit_modrm(3, dst, src); }
+static void alu_r_imm(int op, int r, uint32_t imm) { emit8(0x81); emit_modrm(3, op, r); emit32(imm); }
+static void alu_x_imm(int op, int r, uint32_t imm) { REX_W(); alu_r_imm(op, r, imm); }
+static void alu_r_cpu(int op, int r, uint32_t off) {
+  emit8(op * 8 + 3); emit_modrm(2, r, RBX); emit32(off);
+}
+static void alu_x_cpu(int op, int r, uint32_t off) { REX_W(); alu_r_cpu(op, r, off); }
+static void shift_r_imm(int op, int r, int sh) { emit8(0xc1); emit_modrm(3, op, r); emit8(sh); }
+static void shift_x_imm(int op, int r, int sh) { REX_W(); shift_r_imm(op, r, sh); }
+static void shift_r_cl(int op, int r) { emit8(0xd3); emit_modrm(3, op, r); }
+static void shift_x_cl(int op, int r) { REX_W(); shift_r_cl(op, r); }
+// r = (condition `cc` holds) ? 1 : 0, for r < RSP
+static void setcc_r(int cc, int r) {
+  emit8(0x0f); emit8(0x90 + cc); emit_modrm(3, 0, r);
+  emit8(0x0f); emit8(0xb6); emit_modrm(3, r, r);
+}
+static void test_r_r(int r1, int r2) { emit8(0x85); emit_modrm(3, r2, r1); }
+static void call_abs(const void *f) { mov_r_imm64(RAX, (uintptr_t)f); emit8(0xff); emit_modrm(3, 2, RAX); }
+
+// return the address of the rel32 field to patch
+static uint8_t* jcc_rel32(int cc) { emit8(0x0f); emit8(0x80 + cc); emit32(0); return code - 4; }
+static uint8_t* jmp_rel32() { emit8(0xe9); emit32(0); return code - 4; }
+static void patch_rel32(uint8_t *at, uint8_t *target) {
+  uint32_t rel = target - (at + 4);
+  memcpy(at, &rel, 4);
+}
+
+// r12 holds guest_to_host(0), so the guest memory at `rax` is [r12 + rax]
+static void mov_r_guest(int len, bool sext, int r) {
+  // loads are sign-extended to XLEN bits, zero-extension to 64 bits is implicit
+  bool w = len == 8 || (sext && sizeof(word_t) == 8);
+  emit8(w ? 0x49 : 0x41);
+  switch (len) {
+    case 1: emit8(0x0f); emit8(sext ? 0xbe : 0xb6); break;
+    case 2: emit8(0x0f); emit8(sext ? 0xbf : 0xb7); break;
+    case 4: emit8(w ? 0x63 : 0x8b); break;
+    case 8: emit8(0x8b); break;
+    default: panic("bad len = %d", len);
+  }
+  emit_modrm(0, r, 4); emit8(0x04); // SIB: base = r12, index = rax
+}
+static void mov_guest_r(int len, int r) {
+  if (len == 2) emit8(0x66);
+  emit8(len == 8 ? 0x49 : 0x41);
+  emit8(len == 1 ? 0x88 : 0x89);
+  emit_modrm(0, r, 4); emit8(0x04);
+}
+
+static void jmp_to(uint8_t *target) { patch_rel32(jmp_rel32(), target); }
+static void add_rdx_rcx() { emit8(0x48); emit8(0x01); emit_modrm(3, RCX, RDX); }
+
+/* In the translated code, r13 holds the number of instructions which can
+ * still be executed, and r14 counts the instructions executed.
+ */
+static void count_inst(int nr_inst) {
+  emit8(0x49); emit8(0x81); emit_modrm(3, ALU_ADD, 6); emit32(nr_inst); // add r14, nr_inst
+  emit8(0x49); emit8(0x81); emit_modrm(3, ALU_SUB, 5); emit32(nr_inst); // sub r13, nr_inst
+}
+
+// uint64_t jit_enter(uint64_t budget, void *entry)
+static void emit_enter() {
+  emit8(0x53);              // push rbx
+  emit8(0x55);              // push rbp
+  emit8(0x41); emit8(0x54); // push r12
+  emit8(0x41); emit8(0x55); // push r13
+  emit8(0x41); emit8(0x56); // push r14, the stack is now aligned for calls
+  mov_r_imm64(RBX, (uintptr_t)&cpu);
+  emit8(0x49); emit8(0xbc); // movabs r12, imm64
+  emit64((uintptr_t)guest_to_host(PMEM_LEFT) - PMEM_LEFT);
+  emit8(0x49); emit8(0x89); emit_modrm(3, RDI, 5); // mov r13, rdi
+  emit8(0x45); emit8(0x31); emit_modrm(3, 6, 6);   // xor r14d, r14d
+  emit8(0xff); emit_modrm(3, 4, RSI);              // jmp rsi
+}
+
+// return the number of instructions executed to execute()
+static void emit_leave() {
+  emit8(0x4c); emit8(0x89); emit_modrm(3, 6, RAX); // mov rax, r14
+  emit8(0x41); emit8(0x5e); // pop r14
+  emit8(0x41); emit8(0x5d); // pop r13
+  emit8(0x41); emit8(0x5c); // pop r12
+  emit8(0x5d);              // pop rbp
+  emit8(0x5b);              // pop rbx
+  emit8(0xc3);              // ret
+}
+
+// leave if the budget is not enough for the `n` instructions of a block
+static void emit_chain_entry(int n) {
+  emit8(0x49); emit8(0x81); emit_modrm(3, ALU_CMP, 5); emit32(n); // cmp r13, n
+  patch_rel32(jcc_rel32(CC_B), jit_leave);
+}
+
+#ifdef CONFIG_DIFFTEST
+static void leave_if_not_running() {
+  mov_r_imm64(RAX, (uintptr_t)&nemu_state.state);
+  emit8(0x83); emit_modrm(0, ALU_CMP, RAX); emit8(NEMU_RUNNING);
+  patch_rel32(jcc_rel32(CC_NE), jit_leave);
+}
+#endif
+
+// --- exits of the translated code ---
+
+enum {
+  EXIT_PC_SET, // cpu.pc is already set and checked by difftest
+  EXIT_PC_IMM, // cpu.pc = target
+  EXIT_PC_EAX, // cpu.pc = eax
+};
+
+typedef struct {
+  uint8_t *patch;
+  int type;
+  vaddr_t pc, target;
+  int nr_inst; // number of instructions executed when leaving here
+  bool ret;    // the exit is a function return
+  bool leave;  // return to execute() without chaining
+} Exit;
+
+static Exit exits[BLOCK_MAX_INST * 3];
+static int nr_exit = 0;
+
+static Exit* add_exit(uint8_t *patch, int type, vaddr_t pc, vaddr_t target, int nr_inst) {
+  Assert(nr_exit < ARRLEN(exits), "too many exits in a block");
+  exits[nr_exit] = (Exit) { .patch = patch, .type = type, .pc = pc, .target = target, .nr_inst = nr_inst };
+  return &exits[nr_exit ++];
+}
+
+// push `ret_pc` to the return-address stack
+static void emit_ras_push(vaddr_t ret_pc) {
+  void **cell = &cells[nr_cell ++];
+  *cell = NULL;
+  mov_r_imm64(RDX, (uintptr_t)&ras_top);
+  emit8(0x8b); emit_modrm(0, RCX, RDX); // mov ecx, [rdx]
+  alu_r_imm(ALU_ADD, RCX, 1);
+  alu_r_imm(ALU_AND, RCX, RAS_NR_ENTRY - 1);
+  emit8(0x89); emit_modrm(0, RCX, RDX); // mov [rdx], ecx
+  shift_r_imm(SH_SHL, RCX, 4);
+  mov_r_imm64(RDX, (uintptr_t)ras);
+  add_rdx_rcx();
+  mov_r_word(RAX, ret_pc);
+  REX_W(); emit8(0x89); emit_modrm(0, RAX, RDX); // mov [rdx], rax
+  mov_r_imm64(RAX, (uintptr_t)cell);
+  emit8(0x48); emit8(0x89); emit_modrm(1, RAX, RDX); emit8(8); // mov [rdx + 8], rax
+}
+
+// pop the return-address stack, and jump to the block there if it predicts rax
+static void emit_ras_pop() {
+  mov_r_imm64(RDX, (uintptr_t)&ras_top);
+  emit8(0x8b); emit_modrm(0, RCX, RDX); // mov ecx, [rdx]
+  mov_r_r(RSI, RCX);
+  alu_r_imm(ALU_SUB, RSI, 1);
+  alu_r_imm(ALU_AND, RSI, RAS_NR_ENTRY - 1);
+  emit8(0x89); emit_modrm(0, RSI, RDX); // mov [rdx], esi
+  shift_r_imm(SH_SHL, RCX, 4);
+  mov_r_imm64(RDX, (uintptr_t)ras);
+  add_rdx_rcx();
+  REX_W(); emit8(0x3b); emit_modrm(0, RAX, RDX); // cmp rax, [rdx]
+  uint8_t *miss = jcc_rel32(CC_NE);
+  emit8(0x48); emit8(0x8b); emit_modrm(1, RCX, RDX); emit8(8); // mov rcx, [rdx + 8]
+  emit8(0x48); emit8(0x8b); emit_modrm(0, RDX, RCX);           // mov rdx, [rcx]
+  emit8(0x48); test_r_r(RDX, RDX);
+  uint8_t *empty = jcc_rel32(CC_E);
+  emit8(0xff); emit_modrm(3, 4, RDX); // jmp rdx
+  patch_rel32(empty, code);
+  mov_r_imm64(RDX, (uintptr_t)&pending_pc);
+  REX_W(); emit8(0x89); emit_modrm(0, RAX, RDX); // mov [rdx], rax
+  mov_r_imm64(RAX, (uintptr_t)&pending_cell);
+  emit8(0x48); emit8(0x89); emit_modrm(0, RCX, RAX); // mov [rax], rcx
+  jmp_to(jit_leave);
+  patch_rel32(miss, code);
+}
+
+// jump to the block at rax if it is in the indirect-branch target cache
+static void emit_ibtc_lookup() {
+  mov_r_r(RCX, RAX);
+  shift_r_imm(SH_SHR, RCX, 2);
+  alu_r_imm(ALU_AND, RCX, IBTC_NR_ENTRY - 1);
+  shift_r_imm(SH_SHL, RCX, 4);
+  mov_r_imm64(RDX, (uintptr_t)ibtc);
+  add_rdx_rcx();
+  REX_W(); emit8(0x3b); emit_modrm(0, RAX, RDX); // cmp rax, [rdx]
+  patch_rel32(jcc_rel32(CC_NE), jit_leave);
+  emit8(0xff); emit_modrm(1, 4, RDX); emit8(8); // jmp [rdx + 8]
+}
+
+static void emit_exit(Exit *x) {
+  patch_rel32(x->patch, code);
+  if (x->type == EXIT_PC_IMM) mov_cpu_word(PC_OFF, x->target);
+  else if (x->type == EXIT_PC_EAX) mov_cpu_r(PC_OFF, RAX);
+#ifdef CONFIG_DIFFTEST
+  if (x->type != EXIT_PC_SET) {
+    mov_r_word(RDI, x->pc);
+    mov_r_cpu(RSI, PC_OFF);
+    call_abs(difftest_step);
+  }
+#endif
+  count_inst(x->nr_inst);
+  if (x->type == EXIT_PC_SET || x->leave) { jmp_to(jit_leave); return; }
+  IFDEF(CONFIG_DIFFTEST, leave_if_not_running());
+
+  if (x->type == EXIT_PC_IMM) {
+    // jump to the next block directly once it is chained by jit_exec()
+    uint8_t *site = jmp_rel32();
+    patch_rel32(site, code);
+    mov_r_imm64(RAX, (uintptr_t)site);
+    mov_r_imm64(RCX, (uintptr_t)&pending_jmp);
+    emit8(0x48); emit8(0x89); emit_modrm(0, RAX, RCX); // mov [rcx], rax
+    mov_r_word(RAX, x->target);
+    mov_r_imm64(RCX, (uintptr_t)&pending_pc);
+    REX_W(); emit8(0x89); emit_modrm(0, RAX, RCX); // mov [rcx], rax
+    jmp_to(jit_leave);
+  } else {
+    IFDEF(CONFIG_DIFFTEST, mov_r_cpu(RAX, PC_OFF));
+    if (x->ret) emit_ras_pop();
+    emit_ibtc_lookup();
+  }
+}
+
+// --- translation ---
+
+// emitted after an instruction which falls through
+static void inst_done(vaddr_t pc, int nr_inst) {
+#ifdef CONFIG_DIFFTEST
+  mov_cpu_word(PC_OFF, pc + 4);
+  mov_r_word(RDI, pc);
+  mov_r_word(RSI, pc + 4);
+  call_abs(difftest_step);
+  mov_r_imm64(RAX, (uintptr_t)&nemu_state.state);
+  emit8(0x83); emit_modrm(0, ALU_CMP, RAX); emit8(NEMU_RUNNING);
+  add_exit(jcc_rel32(CC_NE), EXIT_PC_SET, pc, 0, nr_inst);
+#endif
+}
+
+// x1 and x5 are link registers, see the hints of jal and jalr in the manual
+static bool is_link(int r) { return r == 1 || r == 5; }
+
+/* Compute the guest address `R(rs1) + imm` into rax, and compare it with
+ * the bound of pmem. Note that vaddr_read() and vaddr_write() do not
+ * translate addresses, so the guest memory can be accessed directly if the
+ * address is in pmem. Otherwise the access goes through vaddr_read() or
+ * vaddr_write() to reach the devices.
+ */
+static uint8_t* guest_addr(int rs1, word_t imm) {
+  mov_r_cpu(RAX, GPR_OFF(rs1));
+  if (imm != 0) alu_x_imm(ALU_ADD, RAX, imm);
+  mov_x_r(RCX, RAX);
+  if ((word_t)CONFIG_MBASE == (word_t)SEXT(CONFIG_MBASE, 32)) alu_x_imm(ALU_SUB, RCX, CONFIG_MBASE);
+  else {
+    mov_r_imm64(RSI, CONFIG_MBASE);
+    REX_W(); emit8(0x29); emit_modrm(3, RSI, RCX); // sub rcx, rsi
+  }
+  // an imm32 is sign-extended, and rcx is zero-extended on riscv32
+  if ((uint64_t)CONFIG_MSIZE <= 0x7fffffff) alu_x_imm(ALU_CMP, RCX, CONFIG_MSIZE);
+  else {
+    mov_r_imm64(RSI, CONFIG_MSIZE);
+    emit8(0x48); emit8(0x39); emit_modrm(3, RSI, RCX); // cmp rcx, rsi
+  }
+  return jcc_rel32(CC_AE);
+}
+
+static void translate_load(vaddr_t pc, int rd, int rs1, word_t imm, int len, bool sext) {
+  uint8_t *slow = guest_addr(rs1, imm);
+  mov_r_guest(len, sext, RDX);
+  uint8_t *done = jmp_rel32();
+  patch_rel32(slow, code);
+  mov_cpu_word(PC_OFF, pc); // reported by devices on errors
+  mov_x_r(RDI, RAX);
+  mov_r_imm(RSI, len);
+  call_abs(vaddr_read);
+  if (sext && len < 4) movsx_x_r(len, RDX, RAX);
+  else if (sext && len < sizeof(word_t)) movsxd_r_r(RDX, RAX);
+  else mov_x_r(RDX, RAX);
+  patch_rel32(done, code);
+  if (rd != 0) mov_cpu_r(GPR_OFF(rd), RDX);
+}
+
+/* Stores to chunks holding cached code must go through vaddr_write() to
+ * invalidate the code. The fast path only checks the chunk of the address,
+ * so misaligned stores, which may cross chunks, take the slow path.
+ */
+static void translate_store(vaddr_t pc, int rs1, int rs2, word_t imm, int len, int nr_inst) {
+  mov_r_cpu(RDX, GPR_OFF(rs2));
+  uint8_t *slow = guest_addr(rs1, imm);
+  uint8_t *misaligned = NULL;
+  if (len > 1) {
+    emit8(0xa8); emit8(len - 1); // test al, len - 1
+    misaligned = jcc_rel32(CC_NE);
+  }
+  mov_r_r(RDI, RCX);
+  shift_r_imm(SH_SHR, RCX, PAGE_SHIFT);
+  shift_r_imm(SH_SHR, RDI, CODE_CHUNK_SHIFT);
+  mov_r_imm64(RSI, (uintptr_t)pmem_code_map);
+  emit8(0x48); emit8(0x8b); emit_modrm(0, RSI, 4); emit8(0xce); // mov rsi, [rsi + rcx * 8]
+  emit8(0x48); emit8(0x0f); emit8(0xa3); emit_modrm(3, RDI, RSI); // bt rsi, rdi
+  uint8_t *has_code = jcc_rel32(CC_B);
+  mov_guest_r(len, RDX);
+#ifdef CONFIG_PMEM_DIRTY
+  // rcx still holds the page of the aligned store
+  mov_r_imm64(RSI, (uintptr_t)pmem_dirty_map);
+  emit8(0xc6); emit_modrm(0, 0, 4); emit8(0x0e); emit8(1); // mov byte [rsi + rcx], 1
+#endif
+  uint8_t *done = jmp_rel32();
+  patch_rel32(slow, code);
+  if (misaligned) patch_rel32(misaligned, code);
+  patch_rel32(has_code, code);
+  mov_cpu_word(PC_OFF, pc);
+  mov_x_r(RDI, RAX);
+  mov_r_imm(RSI, len);
+  call_abs(vaddr_write);
+  // leave if the store has invalidated translated code, which may be this block
+  mov_r_imm64(RAX, (uintptr_t)&stale);
+  emit8(0x80); emit_modrm(0, ALU_CMP, RAX); emit8(0); // cmp byte [rax], 0
+  add_exit(jcc_rel32(CC_NE), EXIT_PC_IMM, pc, pc + 4, nr_inst)->leave = true;
+  patch_rel32(done, code);
+}
+
+/* The name of the pattern whose body the translation of `i` mirrors, or
+ * NULL if `i` is never translated.
+ */
+static const char* inst_name(uint32_t i) {
+  static const char *op_imm[8] = { "addi", "slli", "slti", "sltiu", "xori", NULL, "ori", "andi" };
+  static const char *op[8] = { "add", "sll", "slt", "sltu", "xor", NULL, "or", "and" };
+  static const char *load[8] = { "lb", "lh", "lw", "ld", "lbu", "lhu", "lwu", NULL };
+  static const char *store[8] = { "sb", "sh", "sw", "sd" };
+  static const char *branch[8] = { "beq", "bne", NULL, NULL, "blt", "bge", "bltu", "bgeu" };
+  uint32_t funct3 = BITS(i, 14, 12);
+  bool alt = BITS(i, 30, 30); // sub and arithmetic shifts
+  switch (BITS(i, 6, 0)) {
+    case 0x37: return "lui";
+    case 0x17: return "auipc";
+    case 0x13: return (funct3 == 5 ? (alt ? "srai" : "srli") : op_imm[funct3]);
+    case 0x33: return (funct3 == 5 ? (alt ? "sra" : "srl") : (funct3 == 0 && alt) ? "sub" : op[funct3]);
+    case 0x1b: return (funct3 == 5 ? (alt ? "sraiw" : "srliw") : funct3 == 1 ? "slliw" : "addiw");
+    case 0x3b: return (funct3 == 5 ? (alt ? "sraw" : "srlw") : funct3 == 1 ? "sllw" : alt ? "subw" : "addw");
+    case 0x03: return load[funct3];
+    case 0x23: return store[funct3];
+    case 0x63: return branch[funct3];
+    case 0x6f: return "jal";
+    case 0x67: return "jalr";
+    default: return NULL;
+  }
+}
+
+/* Translate the RV32I or RV64I instruction `e` inline. Return false if it is not
+ * supported here, and it will be executed by its INSTPAT() body instead.
+ * Only an instruction matched by the pattern of the same name is
+ * translated, so that the translation never runs other semantics than
+ * the body in inst.c. `end` is set if the instruction always leaves the
+ * block.
+ */
+static bool translate_inst(DecodeCacheEntry *e, int nr_inst, bool last, bool *end) {
+  uint32_t i = e->isa.inst.val;
+  const char *name = inst_name(i);
+  if (name == NULL || !dcache_is(e, name)) return false;
+  vaddr_t pc = e->pc;
+  int rd = BITS(i, 11, 7), rs1 = BITS(i, 19, 15), rs2 = BITS(i, 24, 20);
+  uint32_t funct3 = BITS(i, 14, 12), funct7 = BITS(i, 31, 25);
+  word_t immI = SEXT(BITS(i, 31, 20), 12);
+  word_t immU = SEXT(BITS(i, 31, 12), 20) << 12;
+  word_t immS = SEXT((BITS(i, 31, 25) << 5) | BITS(i, 11, 7), 12);
+  word_t immB = SEXT((BITS(i, 31, 31) << 12) | (BITS(i, 7, 7) << 11) |
+                     (BITS(i, 30, 25) << 5) | (BITS(i, 11, 8) << 1), 13);
+  word_t immJ = SEXT((BITS(i, 31, 31) << 20) | (BITS(i, 19, 12) << 12) |
+                     (BITS(i, 20, 20) << 11) | (BITS(i, 30, 21) << 1), 21);
+  static const int alu_op[8] = { [0] = ALU_ADD, [4] = ALU_XOR, [6] = ALU_OR, [7] = ALU_AND };
+  // on riscv64, shamt of op-imm is 6 bits, and its high bit is the low bit of funct7
+  int shamt = BITS(i, MUXDEF(CONFIG_RV64, 25, 24), 20);
+  uint32_t shfunct = funct7 & ~MUXDEF(CONFIG_RV64, 1u, 0u);
+
+  *end = false;
+  switch (BITS(i, 6, 0)) {
+    case 0x37: // lui
+      if (rd != 0) mov_cpu_word(GPR_OFF(rd), immU);
+      break;
+    case 0x17: // auipc
+      if (rd != 0) mov_cpu_word(GPR_OFF(rd), pc + immU);
+      break;
+    case 0x13: // op-imm
+      if ((funct3 == 1 && shfunct != 0) || (funct3 == 5 && (shfunct & ~0x20) != 0)) return false;
+      if (rd == 0) break;
+      mov_r_cpu(RAX, GPR_OFF(rs1));
+      switch (funct3) {
+        case 2: alu_x_imm(ALU_CMP, RAX, immI); setcc_r(CC_L, RAX); break;
+        case 3: alu_x_imm(ALU_CMP, RAX, immI); setcc_r(CC_B, RAX); break;
+        case 1: shift_x_imm(SH_SHL, RAX, shamt); break;
+        case 5: shift_x_imm(shfunct ? SH_SAR : SH_SHR, RAX, shamt); break;
+        default: alu_x_imm(alu_op[funct3], RAX, immI); break;
+      }
+      mov_cpu_r(GPR_OFF(rd), RAX);
+      break;
+    case 0x33: // op
+      if (funct7 != 0 && !(funct7 == 0x20 && (funct3 == 0 || funct3 == 5))) return false;
+      if (rd == 0) break;
+      mov_r_cpu(RAX, GPR_OFF(rs1));
+      switch (funct3) {
+        case 0: alu_x_cpu(funct7 ? ALU_SUB : ALU_ADD, RAX, GPR_OFF(rs2)); break;
+        case 2: alu_x_cpu(ALU_CMP, RAX, GPR_OFF(rs2)); setcc_r(CC_L, RAX); break;
+        case 3: alu_x_cpu(ALU_CMP, RAX, GPR_OFF(rs2)); setcc_r(CC_B, RAX); break;
+        case 1: mov_r_cpu(RCX, GPR_OFF(rs2)); shift_x_cl(SH_SHL, RAX); break;
+        case 5: mov_r_cpu(RCX, GPR_OFF(rs2)); shift_x_cl(funct7 ? SH_SAR : SH_SHR, RAX); break;
+        default: alu_x_cpu(alu_op[funct3], RAX, GPR_OFF(rs2)); break;
+      }
+      mov_cpu_r(GPR_OFF(rd), RAX);
+      break;
+#ifdef CONFIG_RV64
+    // the 32-bit operations compute on eax, and sign-extend the result
+    case 0x1b: // op-imm-32
+      if (funct3 != 0 && funct3 != 1 && funct3 != 5) return false;
+      if ((funct3 == 1 && funct7 != 0) || (funct3 == 5 && (funct7 & ~0x20) != 0)) return false;
+      if (rd == 0) break;
+      mov_r_cpu(RAX, GPR_OFF(rs1));
+      switch (funct3) {
+        case 0: alu_r_imm(ALU_ADD, RAX, immI); break;
+        case 1: shift_r_imm(SH_SHL, RAX, rs2); break;
+        case 5: shift_r_imm(funct7 ? SH_SAR : SH_SHR, RAX, rs2); break;
+      }
+      movsxd_r_r(RAX, RAX);
+      mov_cpu_r(GPR_OFF(rd), RAX);
+      break;
+    case 0x3b: // op-32
+      if (funct3 != 0 && funct3 != 1 && funct3 != 5) return false;
+      if (funct7 != 0 && !(funct7 == 0x20 && (funct3 == 0 || funct3 == 5))) return false;
+      if (rd == 0) break;
+      mov_r_cpu(RAX, GPR_OFF(rs1));
+      switch (funct3) {
+        case 0: alu_r_cpu(funct7 ? ALU_SUB : ALU_ADD, RAX, GPR_OFF(rs2)); break;
+        case 1: mov_r_cpu(RCX, GPR_OFF(rs2)); shift_r_cl(SH_SHL, RAX); break;
+        case 5: mov_r_cpu(RCX, GPR_OFF(rs2)); shift_r_cl(funct7 ? SH_SAR : SH_SHR, RAX); break;
+      }
+      movsxd_r_r(RAX, RAX);
+      mov_cpu_r(GPR_OFF(rd), RAX);
+      break;
+#endif
+    case 0x03: // load
+      switch (funct3) {
+        case 0: translate_load(pc, rd, rs1, immI, 1, true); break;
+        case 1: translate_load(pc, rd, rs1, immI, 2, true); break;
+        case 2: translate_load(pc, rd, rs1, immI, 4, true); break;
+        case 4: translate_load(pc, rd, rs1, immI, 1, false); break;
+        case 5: translate_load(pc, rd, rs1, immI, 2, false); break;
+#ifdef CONFIG_RV64
+        case 3: translate_load(pc, rd, rs1, immI, 8, false); break;
+        case 6: translate_load(pc, rd, rs1, immI, 4, false); break;
+#endif
+        default: return false;
+      }
+      break;
+    case 0x23: // store
+      if (funct3 > MUXDEF(CONFIG_RV64, 3, 2)) return false;
+      translate_store(pc, rs1, rs2, immS, 1 << funct3, nr_inst);
+      break;
+    case 0x63: { // branch
+      static const int cc[8] = { CC_E, CC_NE, -1, -1, CC_L, CC_GE, CC_B, CC_AE };
+      if (cc[funct3] < 0) return false;
+      mov_r_cpu(RAX, GPR_OFF(rs1));
+      alu_x_cpu(ALU_CMP, RAX, GPR_OFF(rs2));
+      add_exit(jcc_rel32(cc[funct3]), EXIT_PC_IMM, pc, pc + immB, nr_inst);
+      if (last) {
+        add_exit(jmp_rel32(), EXIT_PC_IMM, pc, pc + 4, nr_inst);
+        *end = true;
+        return true;
+      }
+      break;
+    }
+    case 0x6f: // jal
+      if (is_link(rd)) emit_ras_push(pc + 4);
+      if (rd != 0) mov_cpu_word(GPR_OFF(rd), pc + 4);
+      add_exit(jmp_rel32(), EXIT_PC_IMM, pc, pc + immJ, nr_inst);
+      *end = true;
+      return true;
+    case 0x67: // jalr
+      if (funct3 != 0) return false;
+      if (is_link(rd)) emit_ras_push(pc + 4);
+      mov_r_cpu(RAX, GPR_OFF(rs1));
+      if (immI != 0) alu_x_imm(ALU_ADD, RAX, immI);
+      alu_x_imm(ALU_AND, RAX, ~1u);
+      if (rd != 0) mov_cpu_word(GPR_OFF(rd), pc + 4);
+      add_exit(jmp_rel32(), EXIT_PC_EAX, pc, 0, nr_inst)->ret = (rd == 0 && is_link(rs1));
+      *end = true;
+      return true;
+    default: return false;
+  }
+  inst_done(pc, nr_inst);
+  return true;
+}
+
+/* Execute an instruction which is not translated inline, and return
+ * whether the translated code can go on with the next instruction.
+ */
+static int jit_exec_inst(DecodeCacheEntry *e) {
+  Decode s;
+  s.pc = e->pc;
+  dcache_use(&s, e);
+  isa_exec_once(&s);
+  cpu.pc = s.dnpc;
+  IFDEF(CONFIG_DIFFTEST, difftest_step(s.pc, cpu.pc));
+  return nemu_state.state == NEMU_RUNNING && cpu.pc == s.snpc && !stale;
+}
+
+void jit_reset() {
+  pending_jmp = NULL;
+  pending_cell = NULL;
+  pending_pc = PC_INVALID;
+}
+
+static void flush_code_cache() {
+  int i;
+  for (i = 0; i < BLOCK_NR_ENTRY; i ++) {
+    bcache[i].code = NULL;
+    bcache[i].nr_exec = 0;
+  }
+  for (i = 0; i < IBTC_NR_ENTRY; i ++) ibtc[i].pc = PC_INVALID;
+  for (i = 0; i < RAS_NR_ENTRY; i ++) ras[i].pc = PC_INVALID;
+  nr_trans = 0;
+  nr_cell = 0;
+  jit_reset();
+  code = code_start;
+}
+
+static void init_code_cache() {
+  code_cache = mmap(NULL, CONFIG_JIT_CODE_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  Assert(code_cache != MAP_FAILED, "fail to allocate the code cache for JIT");
+  code = code_cache;
+  jit_enter = (void *)code;
+  emit_enter();
+  jit_leave = code;
+  emit_leave();
+  code_start = code;
+  flush_code_cache();
+}
+
+/* Translate a block, and return the entry of the translated code. The
+ * translated code updates `cpu.pc` and counts the instructions executed
+ * before leaving, and it jumps to the translated code of the next block
+ * directly when possible.
+ */
+static void* translate(Block *b) {
+  if (code_cache == NULL) init_code_cache();
+  if (code + JIT_BLOCK_CODE_MAX > code_cache + CONFIG_JIT_CODE_CACHE_SIZE ||
+      nr_trans == JIT_MAX_TRANS || nr_cell == JIT_NR_CELL) {
+    Log("JIT code cache is full, flushing");
+    flush_code_cache();
+  }
+
+  // the translated code outlives `b`, which may be replaced by another block
+  DecodeCacheEntry *inst = (void *)ROUNDUP((uintptr_t)code, 16);
+  memcpy(inst, b->inst, sizeof(inst[0]) * b->n);
+  code = (uint8_t *)(inst + b->n);
+
+  uint8_t *entry = code;
+  nr_exit = 0;
+  emit_chain_entry(b->n);
+  bool end = false;
+  int k;
+  for (k = 0; k < b->n && !end; k ++) {
+    DecodeCacheEntry *e = &inst[k];
+    bool last = (k == b->n - 1);
+    if (translate_inst(e, k + 1, last, &end)) continue;
+    mov_r_imm64(RDI, (uintptr_t)e);
+    call_abs(jit_exec_inst);
+    if (last) {
+      add_exit(jmp_rel32(), EXIT_PC_SET, e->pc, 0, k + 1);
+      end = true;
+    } else {
+      test_r_r(RAX, RAX);
+      add_exit(jcc_rel32(CC_E), EXIT_PC_SET, e->pc, 0, k + 1);
+    }
+  }
+  if (!end) {
+    // the last instruction falls through, and difftest has checked it
+    vaddr_t pc = inst[b->n - 1].pc;
+    add_exit(jmp_rel32(), MUXDEF(CONFIG_DIFFTEST, EXIT_PC_SET, EXIT_PC_IMM), pc, pc + 4, b->n);
+  }
+  int i;
+  for (i = 0; i < nr_exit; i ++) emit_exit(&exits[i]);
+  Assert(code <= (uint8_t *)inst + JIT_BLOCK_CODE_MAX,
+      "translated code of block at " FMT_WORD " is too large", b->pc);
+
+  trans[nr_trans ++] = (Trans) { .start = b->pc, .end = inst[b->n - 1].pc + inst[b->n - 1].ilen, .entry = entry };
+  return entry;
+}
+
+void jit_invalidate(vaddr_t addr, int len) {
+  int i, j;
+  for (i = 0; i < nr_trans; i ++) {
+    Trans *t = &trans[i];
+    if (addr >= t->end || addr + len <= t->start) continue;
+    // the chains to this block now return to execute()
+    t->entry[0] = 0xe9;
+    patch_rel32(t->entry + 1, jit_leave);
+    Block *b = block_lookup(t->start);
+    if (b->code == t->entry) { b->code = NULL; b->nr_exec = 0; }
+    for (j = 0; j < IBTC_NR_ENTRY; j ++) {
+      if (ibtc[j].entry == t->entry) ibtc[j].pc = PC_INVALID;
+    }
+    for (j = 0; j < nr_cell; j ++) {
+      if (cells[j] == t->entry) cells[j] = NULL;
+    }
+    stale = true;
+    trans[i] = trans[-- nr_trans];
+    i --;
+  }
+}
+
+void jit_flush() {
+  need_flush = true;
+  stale = true;
+}
+
+uint64_t jit_exec(uint64_t n) {
+  if (need_flush && code_cache != NULL) flush_code_cache();
+  need_flush = false;
+  stale = false;
+  Block *b = block_lookup(cpu.pc);
+  bool hit = block_hit(b, cpu.pc) && b->n <= n;
+  if (hit && b->code == NULL && ++ b->nr_exec >= JIT_HOT_THRESHOLD) b->code = translate(b);
+
+  // translate() may flush the pending exits
+  uint8_t *jmp = pending_jmp;
+  void **cell = pending_cell;
+  bool chain = (pending_pc == cpu.pc);
+  jit_reset();
+  if (!hit || b->code == NULL) return 0;
+
+  if (chain && jmp != NULL) patch_rel32(jmp, b->code);
+  if (chain && cell != NULL) *cell = b->code;
+  IBTCEntry *t = &ibtc[(cpu.pc >> 2) & (IBTC_NR_ENTRY - 1)];
+  t->pc = cpu.pc;
+  t->entry = b->code;
+  return jit_enter(n < JIT_QUANTUM ? n : JIT_QUANTUM, b->code);
+}
@@ -0,0 +1,40 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <common.h>
+
+/* Execute the translated code of the block starting at `cpu.pc` if it is
+ * not longer than `n` instructions, and return the number of instructions
+ * executed. Return 0 if the block should be executed by exec_block().
+ */
+uint64_t jit_exec(uint64_t n);
+
+/* Drop the translated code of guest code in [addr, addr + len). Blocks
+ * chained to it return to execute() instead.
+ */
+void jit_invalidate(vaddr_t addr, int len);
+
+/* Drop all translated code, e.g. when the translation of guest addresses
+ * changes. The code running now leaves after the current instruction.
+ */
+void jit_flush();
+
+// Forget the exit waiting to be chained, e.g. when the guest is reset.
+void jit_reset();
+
+#endif
@@ -0,0 +1,108 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include "local-include/reg.h"
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <memory/vaddr.h>
+
+#ifdef CONFIG_DECODE_FUSION
+#define R(i) gpr(i)
+#define Mr vaddr_read
+
+/* LoongArch compares registers in its branch instructions, so there is
+ * no compare-and-branch idiom to fuse.
+ */
+enum {
+  FUSE_LU12I_ORI = 1,   // li.w rd, imm
+  FUSE_LU12I_ADDI,      // li.w rd, imm
+  FUSE_PCADDU12I_JIRL,  // call or tail to a far function
+  FUSE_PCADDU12I_LD,    // load from a pc-relative address
+  NR_FUSE
+};
+static_assert(NR_FUSE <= FUSE_MAX_IDIOM, "too many idioms");
+
+static const char *fuse_name[NR_FUSE] = {
+  [FUSE_LU12I_ORI] = "lu12i.w+ori",
+  [FUSE_LU12I_ADDI] = "lu12i.w+addi.w",
+  [FUSE_PCADDU12I_JIRL] = "pcaddu12i+jirl",
+  [FUSE_PCADDU12I_LD] = "pcaddu12i+ld.w",
+};
+
+#define RD(i)     BITS(i, 4, 0)
+#define RJ(i)     BITS(i, 9, 5)
+#define UI12(i)   BITS(i, 21, 10)
+#define SI12(i)   SEXT(BITS(i, 21, 10), 12)
+#define SI20(i)   (SEXT(BITS(i, 24, 5), 20) << 12)
+#define OFFS16(i) (SEXT(BITS(i, 25, 10), 16) << 2)
+
+/* Return the idiom formed by the instructions at e[0] and e[1], or 0 if
+ * they do not form one. The second instruction of an idiom always uses
+ * the result of the first one. The pair is picked by the patterns which
+ * matched it, so that it only runs what their bodies run.
+ */
+int isa_fuse(DecodeCacheEntry *e) {
+  uint32_t i1 = e[0].isa.inst.val, i2 = e[1].isa.inst.val;
+  if (RD(i1) == 0 || RJ(i2) != RD(i1)) return 0;
+  if (dcache_is(&e[0], "lu12i.w")) {
+    if (dcache_is(&e[1], "ori")) return FUSE_LU12I_ORI;
+    if (dcache_is(&e[1], "addi.w")) return FUSE_LU12I_ADDI;
+    return 0;
+  }
+  if (dcache_is(&e[0], "pcaddu12i")) {
+    if (dcache_is(&e[1], "jirl")) return FUSE_PCADDU12I_JIRL;
+    if (dcache_is(&e[1], "ld.w")) return FUSE_PCADDU12I_LD;
+    return 0;
+  }
+  return 0;
+}
+
+const char* isa_fuse_name(int idiom) {
+  return (idiom > 0 && idiom < NR_FUSE ? fuse_name[idiom] : NULL);
+}
+
+/* Execute the pair at s->dc[0] and s->dc[1] as isa_exec_once() executes
+ * them one by one. The first instruction is completed before the second
+ * one accesses memory, so the state is precise if the access fails.
+ */
+void isa_exec_fused(Decode *s, int idiom) {
+  uint32_t i1 = s->dc[0].isa.inst.val, i2 = s->dc[1].isa.inst.val;
+  int rd = RD(i1);
+  vaddr_t pc2 = s->pc + 4;
+  s->dnpc = pc2 + 4;
+  switch (idiom) {
+    case FUSE_LU12I_ORI:
+      R(rd) = SI20(i1);
+      R(RD(i2)) = R(rd) | UI12(i2);
+      break;
+    case FUSE_LU12I_ADDI:
+      R(rd) = SI20(i1);
+      R(RD(i2)) = R(rd) + SI12(i2);
+      break;
+    case FUSE_PCADDU12I_JIRL:
+      R(rd) = s->pc + SI20(i1);
+      s->dnpc = R(rd) + OFFS16(i2);
+      R(RD(i2)) = pc2 + 4;
+      break;
+    case FUSE_PCADDU12I_LD:
+      R(rd) = s->pc + SI20(i1);
+      cpu.pc = pc2;
+      R(RD(i2)) = Mr(R(rd) + SI12(i2), 4);
+      break;
+    default: panic("bad idiom = %d", idiom);
+  }
+  R(0) = 0; // reset $zero to 0
+}
+#endif
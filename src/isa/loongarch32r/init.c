@@ -41,3 +41,8 @@ void init_isa() {
   /* Initialize this virtual computer system. */
   restart();
 }
+
+void isa_reset() {
+  memset(&cpu, 0, sizeof(cpu));
+  restart();
+}
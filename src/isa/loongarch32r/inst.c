@@ -19,22 +19,22 @@
 #include <cpu/decode.h>
 
 #define R(i) gpr(i)
-#define Mr vaddr_read
-#define Mw vaddr_write
+#define Mr VADDR_READ
+#define Mw VADDR_WRITE
 
 enum {
   TYPE_2RI12, TYPE_1RI20,
   TYPE_N, // none
 };
 
-#define src1R()  do { *src1 = R(rj); } while (0)
-#define simm12() do { *imm = SEXT(BITS(i, 21, 10), 12); } while (0)
-#define simm20() do { *imm = SEXT(BITS(i, 24, 5), 20) << 12; } while (0)
+#define src1R()  do { op->rs1 = rj; } while (0)
+#define simm12() do { op->imm = SEXT(BITS(i, 21, 10), 12); } while (0)
+#define simm20() do { op->imm = SEXT(BITS(i, 24, 5), 20) << 12; } while (0)
 
-static void decode_operand(Decode *s, int *rd_, word_t *src1, word_t *src2, word_t *imm, int type) {
+static void decode_operand(Decode *s, DecodeOperand *op, int type) {
   uint32_t i = s->isa.inst.val;
   int rj = BITS(i, 9, 5);
-  *rd_ = BITS(i, 4, 0);
+  op->rd = BITS(i, 4, 0);
   switch (type) {
     case TYPE_1RI20: simm20(); src1R(); break;
     case TYPE_2RI12: simm12(); src1R(); break;
@@ -42,23 +42,30 @@ static void decode_operand(Decode *s, int *rd_, word_t *src1, word_t *src2, word
 }
 
 static int decode_exec(Decode *s) {
-  int rd = 0;
-  word_t src1 = 0, src2 = 0, imm = 0;
+  DecodeOperand op = {};
+  __attribute__((unused)) int rd;
+  __attribute__((unused)) word_t src1, src2, imm;
   s->dnpc = s->snpc;
 
 #define INSTPAT_INST(s) ((s)->isa.inst.val)
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
-  decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
+  decode_operand(s, &op, concat(TYPE_, type)); \
+  INSTPAT_CACHE(s, op, name); \
+  rd = op.rd; src1 = R(op.rs1); src2 = R(op.rs2); imm = op.imm; \
   __VA_ARGS__ ; \
 }
 
   INSTPAT_START();
+#if defined(CONFIG_DECODE_TREE) || defined(CONFIG_DECODE_PGO)
+#include "decode-gen.h" // generated by tools/gen-decode from the list below
+#else
   INSTPAT("0001110 ????? ????? ????? ????? ?????" , pcaddu12i, 1RI20 , R(rd) = s->pc + imm);
   INSTPAT("0010100010 ???????????? ????? ?????"   , ld.w     , 2RI12 , R(rd) = Mr(src1 + imm, 4));
   INSTPAT("0010100110 ???????????? ????? ?????"   , st.w     , 2RI12 , Mw(src1 + imm, 4, R(rd)));
 
   INSTPAT("0000 0000 0010 10100 ????? ????? ?????", break    , N     , NEMUTRAP(s->pc, R(4))); // R(4) is $a0
   INSTPAT("????????????????? ????? ????? ?????"   , inv      , N     , INV(s->pc));
+#endif
   INSTPAT_END();
 
   R(0) = 0; // reset $zero to 0
@@ -67,6 +74,7 @@ static int decode_exec(Decode *s) {
 }
 
 int isa_exec_once(Decode *s) {
+  IFDEF(CONFIG_DECODE_CACHE, if (s->dc != NULL) return decode_exec(s));
   s->isa.inst.val = inst_fetch(&s->snpc, 4);
   return decode_exec(s);
 }
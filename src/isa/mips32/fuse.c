@@ -0,0 +1,108 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include "local-include/reg.h"
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <memory/vaddr.h>
+
+#ifdef CONFIG_DECODE_FUSION
+#define R(i) gpr(i)
+#define Mr vaddr_read
+
+enum {
+  FUSE_LUI_ORI = 1, // li rt, imm
+  FUSE_LUI_ADDIU,   // li rt, imm
+  FUSE_LUI_LW,      // load from an absolute address
+  FUSE_SLT_BRANCH,  // compare, and branch on the result
+  NR_FUSE
+};
+static_assert(NR_FUSE <= FUSE_MAX_IDIOM, "too many idioms");
+
+static const char *fuse_name[NR_FUSE] = {
+  [FUSE_LUI_ORI] = "lui+ori",
+  [FUSE_LUI_ADDIU] = "lui+addiu",
+  [FUSE_LUI_LW] = "lui+lw",
+  [FUSE_SLT_BRANCH] = "slt+beq/bne",
+};
+
+#define OPCODE(i) BITS(i, 31, 26)
+#define RS(i)     BITS(i, 25, 21)
+#define RT(i)     BITS(i, 20, 16)
+#define RD(i)     BITS(i, 15, 11)
+#define FUNCT(i)  BITS(i, 5, 0)
+#define UIMM(i)   BITS(i, 15, 0)
+#define SIMM(i)   SEXT(BITS(i, 15, 0), 16)
+
+/* Return the idiom formed by the instructions at e[0] and e[1], or 0 if
+ * they do not form one. The second instruction of an idiom always uses
+ * the result of the first one. The pair is picked by the patterns which
+ * matched it, so that it only runs what their bodies run.
+ */
+int isa_fuse(DecodeCacheEntry *e) {
+  uint32_t i1 = e[0].isa.inst.val, i2 = e[1].isa.inst.val;
+  if (dcache_is(&e[0], "lui")) {
+    if (RT(i1) == 0 || RS(i2) != RT(i1)) return 0;
+    if (dcache_is(&e[1], "ori")) return FUSE_LUI_ORI;
+    if (dcache_is(&e[1], "addiu")) return FUSE_LUI_ADDIU;
+    if (dcache_is(&e[1], "lw")) return FUSE_LUI_LW;
+    return 0;
+  }
+  // beqz or bnez on the result
+  if ((dcache_is(&e[0], "slt") || dcache_is(&e[0], "sltu")) && RD(i1) != 0 &&
+      (dcache_is(&e[1], "beq") || dcache_is(&e[1], "bne")) &&
+      RS(i2) == RD(i1) && RT(i2) == 0) return FUSE_SLT_BRANCH;
+  return 0;
+}
+
+const char* isa_fuse_name(int idiom) {
+  return (idiom > 0 && idiom < NR_FUSE ? fuse_name[idiom] : NULL);
+}
+
+/* Execute the pair at s->dc[0] and s->dc[1] as isa_exec_once() executes
+ * them one by one. The first instruction is completed before the second
+ * one accesses memory, so the state is precise if the access fails.
+ * Like the rest of NEMU, branches here have no delay slot.
+ */
+void isa_exec_fused(Decode *s, int idiom) {
+  uint32_t i1 = s->dc[0].isa.inst.val, i2 = s->dc[1].isa.inst.val;
+  vaddr_t pc2 = s->pc + 4;
+  s->dnpc = pc2 + 4;
+  switch (idiom) {
+    case FUSE_LUI_ORI:
+      R(RT(i1)) = UIMM(i1) << 16;
+      R(RT(i2)) = R(RS(i2)) | UIMM(i2);
+      break;
+    case FUSE_LUI_ADDIU:
+      R(RT(i1)) = UIMM(i1) << 16;
+      R(RT(i2)) = R(RS(i2)) + SIMM(i2);
+      break;
+    case FUSE_LUI_LW:
+      R(RT(i1)) = UIMM(i1) << 16;
+      cpu.pc = pc2;
+      R(RT(i2)) = Mr(R(RS(i2)) + SIMM(i2), 4);
+      break;
+    case FUSE_SLT_BRANCH: {
+      word_t src1 = R(RS(i1)), src2 = R(RT(i1));
+      bool lt = (FUNCT(i1) == 0x2a ? (sword_t)src1 < (sword_t)src2 : src1 < src2);
+      R(RD(i1)) = lt;
+      if (lt == (OPCODE(i2) == 0x05)) s->dnpc = pc2 + 4 + (SIMM(i2) << 2);
+      break;
+    }
+    default: panic("bad idiom = %d", idiom);
+  }
+  R(0) = 0; // reset $zero to 0
+}
+#endif
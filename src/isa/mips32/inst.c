@@ -19,24 +19,24 @@
 #include <cpu/decode.h>
 
 #define R(i) gpr(i)
-#define Mr vaddr_read
-#define Mw vaddr_write
+#define Mr VADDR_READ
+#define Mw VADDR_WRITE
 
 enum {
   TYPE_I, TYPE_U,
   TYPE_N, // none
 };
 
-#define src1R() do { *src1 = R(rs); } while (0)
-#define src2R() do { *src2 = R(rt); } while (0)
-#define immI() do { *imm = SEXT(BITS(i, 15, 0), 16); } while(0)
-#define immU() do { *imm = BITS(i, 15, 0); } while(0)
+#define src1R() do { op->rs1 = rs; } while (0)
+#define src2R() do { op->rs2 = rt; } while (0)
+#define immI() do { op->imm = SEXT(BITS(i, 15, 0), 16); } while(0)
+#define immU() do { op->imm = BITS(i, 15, 0); } while(0)
 
-static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_t *imm, int type) {
+static void decode_operand(Decode *s, DecodeOperand *op, int type) {
   uint32_t i = s->isa.inst.val;
   int rt = BITS(i, 20, 16);
   int rs = BITS(i, 25, 21);
-  *rd = (type == TYPE_U || type == TYPE_I) ? rt : BITS(i, 15, 11);
+  op->rd = (type == TYPE_U || type == TYPE_I) ? rt : BITS(i, 15, 11);
   switch (type) {
     case TYPE_I: src1R(); immI(); break;
     case TYPE_U: src1R(); immU(); break;
@@ -44,23 +44,30 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_
 }
 
 static int decode_exec(Decode *s) {
-  int rd = 0;
-  word_t src1 = 0, src2 = 0, imm = 0;
+  DecodeOperand op = {};
+  __attribute__((unused)) int rd;
+  __attribute__((unused)) word_t src1, src2, imm;
   s->dnpc = s->snpc;
 
 #define INSTPAT_INST(s) ((s)->isa.inst.val)
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
-  decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
+  decode_operand(s, &op, concat(TYPE_, type)); \
+  INSTPAT_CACHE(s, op, name); \
+  rd = op.rd; src1 = R(op.rs1); src2 = R(op.rs2); imm = op.imm; \
   __VA_ARGS__ ; \
 }
 
   INSTPAT_START();
+#if defined(CONFIG_DECODE_TREE) || defined(CONFIG_DECODE_PGO)
+#include "decode-gen.h" // generated by tools/gen-decode from the list below
+#else
   INSTPAT("001111 ????? ????? ????? ????? ??????", lui    , U, R(rd) = imm << 16);
   INSTPAT("100011 ????? ????? ????? ????? ??????", lw     , I, R(rd) = Mr(src1 + imm, 4));
   INSTPAT("101011 ????? ????? ????? ????? ??????", sw     , I, Mw(src1 + imm, 4, R(rd)));
 
   INSTPAT("011100 ????? ????? ????? ????? 111111", sdbbp  , N, NEMUTRAP(s->pc, R(2))); // R(2) is $v0;
   INSTPAT("?????? ????? ????? ????? ????? ??????", inv    , N, INV(s->pc));
+#endif
   INSTPAT_END();
 
   R(0) = 0; // reset $zero to 0
@@ -69,6 +76,7 @@ static int decode_exec(Decode *s) {
 }
 
 int isa_exec_once(Decode *s) {
+  IFDEF(CONFIG_DECODE_CACHE, if (s->dc != NULL) return decode_exec(s));
   s->isa.inst.val = inst_fetch(&s->snpc, 4);
   return decode_exec(s);
 }
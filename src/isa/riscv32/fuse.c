@@ -0,0 +1,133 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include "local-include/reg.h"
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <memory/vaddr.h>
+
+#ifdef CONFIG_DECODE_FUSION
+#define R(i) gpr(i)
+#define Mr vaddr_read
+
+enum {
+  FUSE_LUI_ADDI = 1, // li rd, imm
+  IFDEF(CONFIG_RV64, FUSE_LUI_ADDIW,)
+  FUSE_AUIPC_JALR,   // call or tail to a far function
+  FUSE_AUIPC_LOAD,   // load from a pc-relative address
+  FUSE_SLT_BRANCH,   // compare, and branch on the result
+  NR_FUSE
+};
+static_assert(NR_FUSE <= FUSE_MAX_IDIOM, "too many idioms");
+
+static const char *fuse_name[NR_FUSE] = {
+  [FUSE_LUI_ADDI] = "lui+addi",
+  IFDEF(CONFIG_RV64, [FUSE_LUI_ADDIW] = "lui+addiw",)
+  [FUSE_AUIPC_JALR] = "auipc+jalr",
+  [FUSE_AUIPC_LOAD] = "auipc+" MUXDEF(CONFIG_RV64, "lw/ld", "lw"),
+  [FUSE_SLT_BRANCH] = "slt+beq/bne",
+};
+
+#define OPCODE(i) BITS(i, 6, 0)
+#define RD(i)     BITS(i, 11, 7)
+#define FUNCT3(i) BITS(i, 14, 12)
+#define RS1(i)    BITS(i, 19, 15)
+#define RS2(i)    BITS(i, 24, 20)
+#define IMM_I(i)  SEXT(BITS(i, 31, 20), 12)
+#define IMM_U(i)  (SEXT(BITS(i, 31, 12), 20) << 12)
+#define IMM_B(i)  SEXT((BITS(i, 31, 31) << 12) | (BITS(i, 7, 7) << 11) | \
+                       (BITS(i, 30, 25) << 5) | (BITS(i, 11, 8) << 1), 13)
+
+// slt, sltu, slti or sltiu
+static bool is_slt(DecodeCacheEntry *e) {
+  return dcache_is(e, "slt") || dcache_is(e, "sltu") || dcache_is(e, "slti") || dcache_is(e, "sltiu");
+}
+
+/* Return the idiom formed by the instructions at e[0] and e[1], or 0 if
+ * they do not form one. The second instruction of an idiom always uses
+ * the result of the first one. The pair is picked by the patterns which
+ * matched it, so that it only runs what their bodies run.
+ */
+int isa_fuse(DecodeCacheEntry *e) {
+  uint32_t i1 = e[0].isa.inst.val, i2 = e[1].isa.inst.val;
+  int rd = RD(i1);
+  if (rd == 0 || RS1(i2) != rd) return 0;
+  if (dcache_is(&e[0], "lui")) {
+    if (dcache_is(&e[1], "addi")) return FUSE_LUI_ADDI;
+    IFDEF(CONFIG_RV64, if (dcache_is(&e[1], "addiw")) return FUSE_LUI_ADDIW);
+    return 0;
+  }
+  if (dcache_is(&e[0], "auipc")) {
+    if (dcache_is(&e[1], "jalr")) return FUSE_AUIPC_JALR;
+    if (dcache_is(&e[1], "lw")) return FUSE_AUIPC_LOAD;
+    IFDEF(CONFIG_RV64, if (dcache_is(&e[1], "ld")) return FUSE_AUIPC_LOAD);
+    return 0;
+  }
+  // bnez or beqz on the result
+  if (is_slt(&e[0]) && (dcache_is(&e[1], "beq") || dcache_is(&e[1], "bne")) && RS2(i2) == 0) {
+    return FUSE_SLT_BRANCH;
+  }
+  return 0;
+}
+
+const char* isa_fuse_name(int idiom) {
+  return (idiom > 0 && idiom < NR_FUSE ? fuse_name[idiom] : NULL);
+}
+
+/* Execute the pair at s->dc[0] and s->dc[1] as isa_exec_once() executes
+ * them one by one. The first instruction is completed before the second
+ * one accesses memory, so the state is precise if the access fails.
+ */
+void isa_exec_fused(Decode *s, int idiom) {
+  uint32_t i1 = s->dc[0].isa.inst.val, i2 = s->dc[1].isa.inst.val;
+  int rd = RD(i1);
+  vaddr_t pc2 = s->pc + 4;
+  s->dnpc = pc2 + 4;
+  switch (idiom) {
+    case FUSE_LUI_ADDI:
+      R(rd) = IMM_U(i1);
+      R(RD(i2)) = R(rd) + IMM_I(i2);
+      break;
+#ifdef CONFIG_RV64
+    case FUSE_LUI_ADDIW:
+      R(rd) = IMM_U(i1);
+      R(RD(i2)) = SEXT(BITS(R(rd) + IMM_I(i2), 31, 0), 32);
+      break;
+#endif
+    case FUSE_AUIPC_JALR:
+      R(rd) = s->pc + IMM_U(i1);
+      s->dnpc = (R(rd) + IMM_I(i2)) & ~(word_t)1;
+      R(RD(i2)) = pc2 + 4;
+      break;
+    case FUSE_AUIPC_LOAD: {
+      R(rd) = s->pc + IMM_U(i1);
+      cpu.pc = pc2;
+      word_t val = Mr(R(rd) + IMM_I(i2), 1 << FUNCT3(i2));
+      R(RD(i2)) = (FUNCT3(i2) == 2 ? SEXT(val, 32) : val);
+      break;
+    }
+    case FUSE_SLT_BRANCH: {
+      word_t src1 = R(RS1(i1));
+      word_t src2 = (OPCODE(i1) == 0x13 ? IMM_I(i1) : R(RS2(i1)));
+      bool lt = (FUNCT3(i1) == 2 ? (sword_t)src1 < (sword_t)src2 : src1 < src2);
+      R(rd) = lt;
+      if (lt == (FUNCT3(i2) == 1)) s->dnpc = pc2 + IMM_B(i2);
+      break;
+    }
+    default: panic("bad idiom = %d", idiom);
+  }
+  R(0) = 0; // reset $zero to 0
+}
+#endif
@@ -19,7 +19,8 @@
 #include <common.h>
 
 typedef struct {
-  word_t gpr[MUXDEF(CONFIG_RVE, 16, 32)];
+  // with threaded dispatch, the last one is the sink for writes to $zero
+  word_t gpr[MUXDEF(CONFIG_RVE, 16, 32) + MUXDEF(CONFIG_THREADED_DISPATCH, 1, 0)];
   vaddr_t pc;
 } MUXDEF(CONFIG_RV64, riscv64_CPU_state, riscv32_CPU_state);
 
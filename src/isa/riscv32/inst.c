@@ -19,25 +19,27 @@
 #include <cpu/decode.h>
 
 #define R(i) gpr(i)
-#define Mr vaddr_read
-#define Mw vaddr_write
+#define Mr VADDR_READ
+#define Mw VADDR_WRITE
 
 enum {
   TYPE_I, TYPE_U, TYPE_S,
   TYPE_N, // none
 };
 
-#define src1R() do { *src1 = R(rs1); } while (0)
-#define src2R() do { *src2 = R(rs2); } while (0)
-#define immI() do { *imm = SEXT(BITS(i, 31, 20), 12); } while(0)
-#define immU() do { *imm = SEXT(BITS(i, 31, 12), 20) << 12; } while(0)
-#define immS() do { *imm = (SEXT(BITS(i, 31, 25), 7) << 5) | BITS(i, 11, 7); } while(0)
+#define src1R() do { op->rs1 = rs1; } while (0)
+#define src2R() do { op->rs2 = rs2; } while (0)
+#define immI() do { op->imm = SEXT(BITS(i, 31, 20), 12); } while(0)
+#define immU() do { op->imm = SEXT(BITS(i, 31, 12), 20) << 12; } while(0)
+#define immS() do { op->imm = (SEXT(BITS(i, 31, 25), 7) << 5) | BITS(i, 11, 7); } while(0)
 
-static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_t *imm, int type) {
+static void decode_operand(Decode *s, DecodeOperand *op, int type) {
   uint32_t i = s->isa.inst.val;
   int rs1 = BITS(i, 19, 15);
   int rs2 = BITS(i, 24, 20);
-  *rd     = BITS(i, 11, 7);
+  op->rd  = BITS(i, 11, 7);
+  // $zero then keeps 0 without being reset after every instruction
+  IFDEF(CONFIG_THREADED_DISPATCH, if (op->rd == 0) op->rd = REG_SINK);
   switch (type) {
     case TYPE_I: src1R();          immI(); break;
     case TYPE_U:                   immU(); break;
@@ -46,31 +48,40 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_
 }
 
 static int decode_exec(Decode *s) {
-  int rd = 0;
-  word_t src1 = 0, src2 = 0, imm = 0;
+  DecodeOperand op = {};
+  __attribute__((unused)) int rd;
+  __attribute__((unused)) word_t src1, src2, imm;
   s->dnpc = s->snpc;
 
 #define INSTPAT_INST(s) ((s)->isa.inst.val)
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
-  decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
+  decode_operand(s, &op, concat(TYPE_, type)); \
+  INSTPAT_CACHE(s, op, name); \
+  rd = op.rd; src1 = R(op.rs1); src2 = R(op.rs2); imm = op.imm; \
   __VA_ARGS__ ; \
 }
 
   INSTPAT_START();
+#if defined(CONFIG_DECODE_TREE) || defined(CONFIG_DECODE_PGO)
+#include "decode-gen.h" // generated by tools/gen-decode from the list below
+#else
   INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc  , U, R(rd) = s->pc + imm);
   INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu    , I, R(rd) = Mr(src1 + imm, 1));
   INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb     , S, Mw(src1 + imm, 1, src2));
 
+  INSTPAT("0001001 ????? ????? 000 00000 11100 11", sfence.vma, N, vaddr_flush());
   INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , N, NEMUTRAP(s->pc, R(10))); // R(10) is $a0
   INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv    , N, INV(s->pc));
+#endif
   INSTPAT_END();
 
-  R(0) = 0; // reset $zero to 0
+  IFNDEF(CONFIG_THREADED_DISPATCH, R(0) = 0); // reset $zero to 0
 
   return 0;
 }
 
 int isa_exec_once(Decode *s) {
+  IFDEF(CONFIG_DECODE_CACHE, if (s->dc != NULL) return decode_exec(s));
   s->isa.inst.val = inst_fetch(&s->snpc, 4);
   return decode_exec(s);
 }
@@ -18,8 +18,11 @@
 
 #include <common.h>
 
+#define NR_GPR MUXDEF(CONFIG_RVE, 16, 32)
+#define REG_SINK NR_GPR // receives writes to $zero, see decode_operand()
+
 static inline int check_reg_idx(int idx) {
-  IFDEF(CONFIG_RT_CHECK, assert(idx >= 0 && idx < MUXDEF(CONFIG_RVE, 16, 32)));
+  IFDEF(CONFIG_RT_CHECK, assert(idx >= 0 && idx < NR_GPR + MUXDEF(CONFIG_THREADED_DISPATCH, 1, 0)));
   return idx;
 }
 
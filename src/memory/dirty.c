@@ -0,0 +1,68 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+#ifdef CONFIG_PMEM_DIRTY
+#define NR_PAGE (CONFIG_MSIZE >> PAGE_SHIFT)
+#define NR_CONSUMER 4
+static_assert(NR_PAGE % 64 == 0, "pmem should be a multiple of 64 pages");
+
+uint8_t pmem_dirty_map[MUXDEF(CONFIG_PMEM_WINDOW, PMEM_WINDOW_SIZE, CONFIG_MSIZE) >> PAGE_SHIFT] PG_ALIGN = {};
+
+// bit p of `pending` is set if page p has been written since the last fetch
+static uint64_t pending[NR_CONSUMER][NR_PAGE / 64] = {};
+static int nr_consumer = 0;
+
+/* Move the pages set in pmem_dirty_map to the pending pages of every
+ * consumer. The map is scanned 8 pages at a time, and the bytes of a
+ * non-zero word, each 0 or 1, are packed into 8 bits by a multiply.
+ */
+static void dirty_collect() {
+  uint64_t *map = (uint64_t *)pmem_dirty_map;
+  int i, c;
+  for (i = 0; i < NR_PAGE / 8; i ++) {
+    uint64_t w = map[i];
+    if (likely(w == 0)) continue;
+    map[i] = 0;
+    uint64_t bits = ((w * 0x0102040810204080ull) >> 56) << (i % 8 * 8);
+    for (c = 0; c < nr_consumer; c ++) pending[c][i / 8] |= bits;
+  }
+  // stores through the TLB only mark their page when it is refilled
+  tlb_flush();
+}
+
+// return the id of a new consumer, which sees no page dirty yet
+int pmem_dirty_register() {
+  Assert(nr_consumer < NR_CONSUMER, "too many consumers of dirty pages");
+  dirty_collect();
+  return nr_consumer ++;
+}
+
+// call `fn` on each page written since the last fetch of consumer `id`
+void pmem_dirty_fetch(int id, void (*fn)(paddr_t page, void *arg), void *arg) {
+  assert(id >= 0 && id < nr_consumer);
+  dirty_collect();
+  int i;
+  for (i = 0; i < NR_PAGE / 64; i ++) {
+    uint64_t w = pending[id][i];
+    pending[id][i] = 0;
+    for (; w != 0; w &= w - 1) {
+      fn(CONFIG_MBASE + (((paddr_t)i * 64 + __builtin_ctzll(w)) << PAGE_SHIFT), arg);
+    }
+  }
+}
+#endif
@@ -15,25 +15,188 @@
 
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <cpu/cpu.h>
 #include <device/mmio.h>
 #include <isa.h>
+#ifdef CONFIG_PMEM_MMAP
+#include <sys/mman.h>
+#include <signal.h>
+#endif
+#ifndef CONFIG_TARGET_AM
+#include <unistd.h>
+#endif
 
-#if   defined(CONFIG_PMEM_MALLOC)
-static uint8_t *pmem = NULL;
+#if   defined(CONFIG_PMEM_MALLOC) || defined(CONFIG_PMEM_MMAP)
+uint8_t *pmem = NULL;
 #else // CONFIG_PMEM_GARRAY
-static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
+uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
+#endif
+
+#ifdef CONFIG_PMEM_WINDOW
+static_assert((uint64_t)CONFIG_MBASE + CONFIG_MSIZE <= PMEM_WINDOW_SIZE, "pmem should fit in the window");
+uint8_t *pmem_window = NULL;
+#endif
+
+#ifdef CONFIG_MEM_RANDOM
+uint8_t pmem_random_byte = 0;
+#endif
+
+#ifdef CONFIG_PMEM_MMAP
+// the unit in which pmem is made accessible and randomized
+#define PMEM_GRANULE MUXDEF(CONFIG_PMEM_HUGEPAGE, (2ul << 20), PAGE_SIZE)
+
+#if defined(CONFIG_MEM_RANDOM) || defined(CONFIG_PMEM_WINDOW)
+/* With MEM_RANDOM, pmem is mapped with PROT_NONE, and the first touch of
+ * a granule, by the guest or by NEMU itself, lands here to enable and
+ * randomize it. With PMEM_WINDOW, accesses to the window out of pmem
+ * land here to be emulated.
+ */
+static void pmem_fault(int sig, siginfo_t *info, void *ucontext) {
+#ifdef CONFIG_MEM_RANDOM
+  uint8_t *p = info->si_addr;
+  if (p >= pmem && p < pmem + CONFIG_MSIZE) {
+    p = pmem + ((p - pmem) & ~(PMEM_GRANULE - 1));
+    if (mprotect(p, PMEM_GRANULE, PROT_READ | PROT_WRITE) == 0) {
+      memset(p, pmem_random_byte, PMEM_GRANULE);
+      return;
+    }
+  }
+#endif
+  IFDEF(CONFIG_PMEM_WINDOW, if (pmem_window_fault(ucontext)) return);
+  // not ours, fault again with the default action
+  signal(SIGSEGV, SIG_DFL);
+}
+#endif
+
+static void init_pmem_mmap() {
+  int prot = MUXDEF(CONFIG_MEM_RANDOM, PROT_NONE, PROT_READ | PROT_WRITE);
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  void *p = MAP_FAILED, *addr = NULL;
+#ifdef CONFIG_PMEM_WINDOW
+  // reserve the window aligned to the granule, and map pmem inside it
+  p = mmap(NULL, PMEM_WINDOW_SIZE + PMEM_GRANULE, PROT_NONE, flags | MAP_NORESERVE, -1, 0);
+  Assert(p != MAP_FAILED, "mmap() for the pmem window failed");
+  pmem_window = (uint8_t *)ROUNDUP(p, PMEM_GRANULE);
+  addr = pmem_window + CONFIG_MBASE;
+  flags |= MAP_FIXED;
+  p = MAP_FAILED;
+#endif
+#ifdef CONFIG_PMEM_HUGEPAGE
+  // reserve the huge pages now, or the first touch will get SIGBUS if they run out
+  p = mmap(addr, CONFIG_MSIZE, prot, flags | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) Log("pmem is backed by MAP_HUGETLB");
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(addr, CONFIG_MSIZE, prot, flags | MAP_NORESERVE, -1, 0);
+    Assert(p != MAP_FAILED, "mmap() for pmem failed");
+    IFDEF(CONFIG_PMEM_HUGEPAGE, madvise(p, CONFIG_MSIZE, MADV_HUGEPAGE));
+  }
+  pmem = p;
+
+#if defined(CONFIG_MEM_RANDOM) || defined(CONFIG_PMEM_WINDOW)
+  struct sigaction s;
+  memset(&s, 0, sizeof(s));
+  s.sa_sigaction = pmem_fault;
+  // devices may touch lazily randomized pmem while an access is emulated
+  s.sa_flags = SA_SIGINFO | SA_NODEFER;
+  int ret = sigaction(SIGSEGV, &s, NULL);
+  Assert(ret == 0, "Can not set signal handler");
+#endif
+}
 #endif
 
-uint8_t* guest_to_host(paddr_t paddr) { return pmem + paddr - CONFIG_MBASE; }
-paddr_t host_to_guest(uint8_t *haddr) { return haddr - pmem + CONFIG_MBASE; }
+void pmem_populate(paddr_t addr, size_t len) {
+#if defined(CONFIG_PMEM_MMAP) && defined(CONFIG_MEM_RANDOM)
+  uint8_t *p = guest_to_host(addr), *g;
+  for (g = pmem + ((p - pmem) & ~(PMEM_GRANULE - 1)); g < p + len; g += PMEM_GRANULE) {
+    (void)*(volatile uint8_t *)g;
+  }
+#endif
+}
+
+#ifndef CONFIG_TARGET_AM
+static void pmem_fill(int fd, size_t off, uint8_t *p, size_t len) {
+  if (fd < 0) { memset(p, 0, len); return; }
+  while (len > 0) {
+    ssize_t n = pread(fd, p, len, off);
+    Assert(n > 0, "Can not read the image at offset %zu", off);
+    p += n; off += n; len -= n;
+  }
+}
+
+void pmem_load(int fd, size_t off, paddr_t addr, size_t len) {
+  uint8_t *p = guest_to_host(addr);
+  // [l, r) of the range is mapped rather than copied
+  size_t l = 0, r = 0;
+#ifdef CONFIG_PMEM_MMAP
+  /* Only map whole granules, so that none is left half randomized by
+   * pmem_fault(). mmap(2) also requires the file offset to be aligned
+   * to the page as the host address is.
+   */
+  size_t base = p - pmem;
+  size_t gl = ROUNDUP(base, PMEM_GRANULE), gr = ROUNDDOWN(base + len, PMEM_GRANULE);
+  if (gl < gr && (fd < 0 || ((off + gl - base) & PAGE_MASK) == 0)) {
+    l = gl - base;
+    r = gr - base;
+    int flags = MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE | (fd < 0 ? MAP_ANONYMOUS : 0);
+    void *m = mmap(p + l, r - l, PROT_READ | PROT_WRITE, flags, fd, fd < 0 ? 0 : off + l);
+    Assert(m == p + l, "mmap() for the image failed");
+  }
+#endif
+  pmem_populate(addr, l);
+  pmem_fill(fd, off, p, l);
+  pmem_populate(addr + r, len - r);
+  pmem_fill(fd, off + r, p + r, len - r);
+}
+#endif
 
 static word_t pmem_read(paddr_t addr, int len) {
   word_t ret = host_read(guest_to_host(addr), len);
   return ret;
 }
 
+#ifdef CONFIG_DECODE_CACHE
+static_assert(PAGE_SIZE == 64 * CODE_CHUNK_SIZE, "a page should have 64 chunks");
+uint64_t pmem_code_map[MUXDEF(CONFIG_PMEM_WINDOW, PMEM_WINDOW_SIZE, CONFIG_MSIZE) >> PAGE_SHIFT] = {};
+
+static inline uint64_t* code_map(paddr_t addr) {
+  return &pmem_code_map[(addr - CONFIG_MBASE) >> PAGE_SHIFT];
+}
+
+static inline uint64_t code_chunk(paddr_t addr) {
+  return 1ull << ((addr & PAGE_MASK) >> CODE_CHUNK_SHIFT);
+}
+
+void pmem_mark_code(paddr_t addr, int len) {
+  paddr_t a;
+  for (a = addr & ~(CODE_CHUNK_SIZE - 1); a < addr + len; a += CODE_CHUNK_SIZE) {
+    // writes to the page should check the map from now on
+    if (*code_map(a) == 0) tlb_flush_paddr(a);
+    *code_map(a) |= code_chunk(a);
+  }
+}
+
+// invalidate the cached code in the chunks written
+void pmem_invalidate_code(paddr_t addr, int len) {
+  paddr_t a;
+  for (a = addr & ~(CODE_CHUNK_SIZE - 1); a < addr + len; a += CODE_CHUNK_SIZE) {
+    uint64_t *map = code_map(a), chunk = code_chunk(a);
+    if (*map & chunk) {
+      *map &= ~chunk;
+      cpu_invalidate_code(a, CODE_CHUNK_SIZE);
+    }
+  }
+}
+#endif
+
 static void pmem_write(paddr_t addr, int len, word_t data) {
+#ifdef CONFIG_DECODE_CACHE
+  if (unlikely(pmem_is_code(addr) || pmem_is_code(addr + len - 1))) pmem_invalidate_code(addr, len);
+#endif
   host_write(guest_to_host(addr), len, data);
+  pmem_mark_dirty(addr);
+  pmem_mark_dirty(addr + len - 1);
 }
 
 static void out_of_bound(paddr_t addr) {
@@ -42,11 +205,16 @@ static void out_of_bound(paddr_t addr) {
 }
 
 void init_mem() {
+  IFDEF(CONFIG_MEM_RANDOM, pmem_random_byte = rand());
 #if   defined(CONFIG_PMEM_MALLOC)
   pmem = malloc(CONFIG_MSIZE);
   assert(pmem);
+#elif defined(CONFIG_PMEM_MMAP)
+  init_pmem_mmap();
 #endif
-  IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
+  // with PMEM_MMAP, randomizing is deferred to the first touch of a page
+  IFNDEF(CONFIG_PMEM_MMAP, IFDEF(CONFIG_MEM_RANDOM, memset(pmem, pmem_random_byte, CONFIG_MSIZE)));
+  tlb_flush();
   Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
 }
 
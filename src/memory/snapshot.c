@@ -0,0 +1,60 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <memory/paddr.h>
+#include <cpu/difftest.h>
+
+#ifdef CONFIG_PMEM_SNAPSHOT
+// a copy of the `snap_size` bytes of pmem from `snap_left`
+static uint8_t *snap = NULL;
+static paddr_t snap_left = 0;
+static size_t snap_size = 0;
+static int dirty_id = -1;
+
+/* Save the pages covering [addr, addr + len), which hold the image just
+ * loaded. The other pages have not been written yet, so they still hold
+ * what pmem was filled with.
+ */
+void pmem_snapshot(paddr_t addr, size_t len) {
+  Assert(snap == NULL, "pmem has been saved");
+  assert(in_pmem(addr));
+  snap_left = addr & ~PAGE_MASK;
+  snap_size = ROUNDUP(addr - snap_left + len, PAGE_SIZE);
+  size_t max = (size_t)PMEM_RIGHT - snap_left + 1;
+  if (snap_size > max) snap_size = max;
+  snap = malloc(snap_size);
+  assert(snap);
+  memcpy(snap, guest_to_host(snap_left), snap_size);
+  dirty_id = pmem_dirty_register();
+}
+
+static void restore_page(paddr_t page, void *arg) {
+  uint8_t *h = guest_to_host(page);
+  if (page - snap_left < snap_size) memcpy(h, snap + (page - snap_left), PAGE_SIZE);
+  else memset(h, MUXDEF(CONFIG_MEM_RANDOM, pmem_random_byte, 0), PAGE_SIZE);
+  IFDEF(CONFIG_DECODE_CACHE, pmem_invalidate_code(page, PAGE_SIZE));
+  IFDEF(CONFIG_DIFFTEST, ref_difftest_memcpy(page, h, PAGE_SIZE, DIFFTEST_TO_REF));
+  // other consumers should see the page written
+  pmem_mark_dirty(page);
+}
+
+static void ignore_page(paddr_t page, void *arg) {}
+
+// restore the pages written since pmem_snapshot()
+void pmem_restore() {
+  pmem_dirty_fetch(dirty_id, restore_page, NULL);
+  pmem_dirty_fetch(dirty_id, ignore_page, NULL);
+}
+#endif
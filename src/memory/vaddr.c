@@ -14,10 +14,128 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <cpu/cpu.h>
+#include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 
-word_t vaddr_ifetch(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+#ifdef CONFIG_SOFT_TLB
+#define TLB_NR_ENTRY CONFIG_SOFT_TLB_SIZE
+static_assert((TLB_NR_ENTRY & (TLB_NR_ENTRY - 1)) == 0,
+    "the size of the TLB should be a power of 2");
+
+// set in the tag of a page which should not be accessed through `addend`,
+// out of the bits of `len - 1` compared on hits
+#define TLB_SLOW (PAGE_SIZE >> 1)
+#define TLB_INVALID ((vaddr_t)-1)
+
+typedef struct {
+  vaddr_t tag;      // the virtual page, with TLB_SLOW if needed
+  paddr_t paddr;    // the physical page
+  uintptr_t addend; // host address - virtual address, if not TLB_SLOW
+} TLBEntry;
+
+// only one hart is simulated, so there is one set of TLBs
+static TLBEntry tlb[3][TLB_NR_ENTRY]; // indexed by MEM_TYPE_*
+uint64_t g_tlb_hit[3] = {}, g_tlb_miss[3] = {};
+
+static inline TLBEntry* tlb_entry(int type, vaddr_t addr) {
+  return &tlb[type][(addr >> PAGE_SHIFT) & (TLB_NR_ENTRY - 1)];
+}
+
+// drop the cached translations, see also vaddr_flush()
+void tlb_flush() {
+  int t, i;
+  for (t = 0; t < 3; t ++) {
+    for (i = 0; i < TLB_NR_ENTRY; i ++) tlb[t][i].tag = TLB_INVALID;
+  }
+  ifetch_flush();
+}
+
+// let writes to the physical page of `addr` take the slow path
+void tlb_flush_paddr(paddr_t addr) {
+  paddr_t page = addr & ~PAGE_MASK;
+  int i;
+  for (i = 0; i < TLB_NR_ENTRY; i ++) {
+    if (tlb[MEM_TYPE_WRITE][i].paddr == page) tlb[MEM_TYPE_WRITE][i].tag = TLB_INVALID;
+  }
+}
+
+/* Translate `addr` with isa_mmu_translate() on a miss, and refill `e` with its page unless the
+ * access crosses the page. Pages out of pmem are flagged TLB_SLOW unless
+ * they belong to a passive MMIO map, and so are pages holding cached code
+ * for writes, which should invalidate it. Writes through the TLB do not
+ * mark the page dirty, so it is marked here, and the TLB is flushed once
+ * the dirty pages are collected.
+ */
+static paddr_t tlb_fill(TLBEntry *e, vaddr_t addr, int len, int type) {
+  vaddr_t page = addr & ~PAGE_MASK;
+  bool cross = (addr & PAGE_MASK) + len > PAGE_SIZE;
+  if (e->tag == (page | TLB_SLOW) && !cross) {
+    g_tlb_hit[type] ++;
+    return e->paddr | (addr & PAGE_MASK);
+  }
+  g_tlb_miss[type] ++;
+  paddr_t pg_base = isa_mmu_translate(addr, len, type);
+  Assert((pg_base & PAGE_MASK) == MEM_RET_OK,
+      "fail to translate vaddr = " FMT_WORD " at pc = " FMT_WORD, addr, cpu.pc);
+  paddr_t paddr = pg_base | (addr & PAGE_MASK);
+  if (cross) return paddr;
+  e->paddr = paddr & ~PAGE_MASK;
+  e->tag = page;
+  if (!in_pmem(paddr)) {
+    // a page of a passive MMIO map is accessed as RAM
+    uint8_t *h = NULL;
+    IFDEF(CONFIG_DEVICE, if (type != MEM_TYPE_IFETCH) h = mmio_passive_page(e->paddr, type == MEM_TYPE_WRITE));
+    if (h != NULL) e->addend = (uintptr_t)h - page;
+    else e->tag |= TLB_SLOW;
+  } else {
+    IFDEF(CONFIG_DECODE_CACHE, if (type == MEM_TYPE_WRITE && pmem_has_code(paddr)) e->tag |= TLB_SLOW);
+    if (type == MEM_TYPE_WRITE) pmem_mark_dirty(paddr);
+    e->addend = (uintptr_t)guest_to_host(e->paddr) - page;
+  }
+  return paddr;
+}
+
+static inline word_t tlb_read(vaddr_t addr, int len, int type) {
+  TLBEntry *e = tlb_entry(type, addr);
+  // misaligned accesses never hit, since the tag is page-aligned
+  if (likely(e->tag == (addr & (~PAGE_MASK | (len - 1))))) {
+    g_tlb_hit[type] ++;
+    return host_read((void *)(addr + e->addend), len);
+  }
+  return paddr_read(tlb_fill(e, addr, len, type), len);
+}
+
+static paddr_t ifetch_translate(vaddr_t addr, int len) {
+  if (isa_mmu_check(addr, len, MEM_TYPE_IFETCH) == MMU_DIRECT) return addr;
+  TLBEntry *e = tlb_entry(MEM_TYPE_IFETCH, addr);
+  if (e->tag == (addr & ~PAGE_MASK)) {
+    g_tlb_hit[MEM_TYPE_IFETCH] ++;
+    return e->paddr | (addr & PAGE_MASK);
+  }
+  return tlb_fill(e, addr, len, MEM_TYPE_IFETCH);
+}
+
+// the TLBs only cache translation, and are skipped in MMU_DIRECT mode
+word_t vaddr_read(vaddr_t addr, int len) {
+  if (isa_mmu_check(addr, len, MEM_TYPE_READ) == MMU_DIRECT) return paddr_read(addr, len);
+  return tlb_read(addr, len, MEM_TYPE_READ);
+}
+
+void vaddr_write(vaddr_t addr, int len, word_t data) {
+  if (isa_mmu_check(addr, len, MEM_TYPE_WRITE) == MMU_DIRECT) { paddr_write(addr, len, data); return; }
+  TLBEntry *e = tlb_entry(MEM_TYPE_WRITE, addr);
+  if (likely(e->tag == (addr & (~PAGE_MASK | (len - 1))))) {
+    g_tlb_hit[MEM_TYPE_WRITE] ++;
+    host_write((void *)(addr + e->addend), len, data);
+    return;
+  }
+  paddr_write(tlb_fill(e, addr, len, MEM_TYPE_WRITE), len, data);
+}
+#else
+static inline paddr_t ifetch_translate(vaddr_t addr, int len) {
+  return addr;
 }
 
 word_t vaddr_read(vaddr_t addr, int len) {
@@ -27,3 +145,50 @@ word_t vaddr_read(vaddr_t addr, int len) {
 void vaddr_write(vaddr_t addr, int len, word_t data) {
   paddr_write(addr, len, data);
 }
+#endif
+
+IFetchPage ifetch_page = { .tag = (vaddr_t)-1 };
+
+void ifetch_flush() {
+  ifetch_page.tag = (vaddr_t)-1; // never page-aligned
+}
+
+/* Besides the translations, drop the code cached by the CPU, which is
+ * looked up by the virtual pc.
+ */
+void vaddr_flush() {
+  tlb_flush();
+  IFDEF(CONFIG_DECODE_CACHE, cpu_flush_code());
+}
+
+#ifdef CONFIG_DECODE_CACHE
+// an instruction straddling two pages is marked in both
+void vaddr_mark_code(vaddr_t addr, int len) {
+  while (len > 0) {
+    int n = PAGE_SIZE - (addr & PAGE_MASK);
+    if (n > len) n = len;
+    paddr_t paddr = ifetch_translate(addr, n);
+    if (in_pmem(paddr)) pmem_mark_code(paddr, n);
+    addr += n;
+    len -= n;
+  }
+}
+#endif
+
+/* Refill `ifetch_page` with the page of `addr`. A fetch straddling two
+ * pages is split into bytes, since the pages need not be adjacent in
+ * physical memory, and code out of pmem is never cached.
+ */
+word_t vaddr_ifetch_slow(vaddr_t addr, int len) {
+  if ((addr & PAGE_MASK) + len > PAGE_SIZE) {
+    word_t ret = 0;
+    int i;
+    for (i = 0; i < len; i ++) ret |= vaddr_ifetch(addr + i, 1) << (i * 8);
+    return ret;
+  }
+  paddr_t paddr = ifetch_translate(addr, len);
+  if (!in_pmem(paddr)) return paddr_read(paddr, len);
+  ifetch_page.tag = addr & ~PAGE_MASK;
+  ifetch_page.host = guest_to_host(paddr & ~PAGE_MASK);
+  return host_read(ifetch_page.host + (addr & PAGE_MASK), len);
+}
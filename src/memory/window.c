@@ -0,0 +1,42 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#define _GNU_SOURCE // for REG_RIP and friends
+#include <ucontext.h>
+#include <memory/paddr.h>
+
+#ifdef CONFIG_PMEM_WINDOW
+// filled by the accessors in paddr.h, and bounded by the linker
+extern const PmemExtable __start_pmem_extable[], __stop_pmem_extable[];
+
+/* Emulate the access of the faulting instruction if it is one of the
+ * accessors. The guest address is recovered from the host address in rdx
+ * rather than the fault address, which may be in the middle of an access
+ * crossing a page.
+ */
+bool pmem_window_fault(void *ucontext) {
+  greg_t *regs = ((ucontext_t *)ucontext)->uc_mcontext.gregs;
+  const PmemExtable *e;
+  for (e = __start_pmem_extable; e < __stop_pmem_extable; e ++) {
+    if (e->insn != regs[REG_RIP]) continue;
+    paddr_t addr = (uint8_t *)regs[REG_RDX] - pmem_window;
+    if (e->is_write) paddr_write(addr, e->len, regs[REG_RAX]);
+    else regs[REG_RAX] = paddr_read(addr, e->len);
+    regs[REG_RIP] = e->next;
+    return true;
+  }
+  return false;
+}
+#endif
@@ -0,0 +1,135 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <memory/paddr.h>
+
+#ifndef CONFIG_TARGET_AM
+#include <elf.h>
+#include <unistd.h>
+
+#define ELF(type) concat(MUXDEF(CONFIG_ISA64, Elf64_, Elf32_), type)
+#define ELF_CLASS MUXDEF(CONFIG_ISA64, ELFCLASS64, ELFCLASS32)
+#define ELF_ST_TYPE MUXDEF(CONFIG_ISA64, ELF64_ST_TYPE, ELF32_ST_TYPE)
+#define ELF_MACHINE \
+  MUXDEF(CONFIG_ISA_x86,         EM_386, \
+  MUXDEF(CONFIG_ISA_mips32,      EM_MIPS, \
+  MUXDEF(CONFIG_ISA_riscv,       EM_RISCV, \
+  MUXDEF(CONFIG_ISA_loongarch32r, EM_LOONGARCH, EM_NONE))))
+
+typedef struct {
+  vaddr_t addr;
+  word_t size;
+  const char *name;
+} Symbol;
+
+// functions and objects of the loaded ELF, sorted by address
+static Symbol *syms = NULL;
+static int nr_sym = 0;
+static char *sym_strtab = NULL;
+
+static void *read_at(int fd, size_t off, size_t len) {
+  uint8_t *buf = malloc(len), *p = buf;
+  assert(buf);
+  while (len > 0) {
+    ssize_t n = pread(fd, p, len, off);
+    Assert(n > 0, "Can not read the ELF at offset %zu", off);
+    p += n; off += n; len -= n;
+  }
+  return buf;
+}
+
+static int sym_cmp(const void *a, const void *b) {
+  vaddr_t x = ((const Symbol *)a)->addr, y = ((const Symbol *)b)->addr;
+  return (x > y) - (x < y);
+}
+
+static void load_symtab(int fd, ELF(Ehdr) *eh) {
+  ELF(Shdr) *sh = read_at(fd, eh->e_shoff, eh->e_shnum * sizeof(ELF(Shdr)));
+  int i;
+  for (i = 0; i < eh->e_shnum && sh[i].sh_type != SHT_SYMTAB; i ++);
+  if (i == eh->e_shnum) {
+    Log("The ELF has no symbol table");
+    free(sh);
+    return;
+  }
+
+  int n = sh[i].sh_size / sizeof(ELF(Sym));
+  ELF(Sym) *sym = read_at(fd, sh[i].sh_offset, sh[i].sh_size);
+  ELF(Shdr) *str = &sh[sh[i].sh_link];
+  sym_strtab = read_at(fd, str->sh_offset, str->sh_size);
+  syms = malloc(n * sizeof(Symbol));
+  assert(syms);
+  for (i = 0; i < n; i ++) {
+    int type = ELF_ST_TYPE(sym[i].st_info);
+    if ((type != STT_FUNC && type != STT_OBJECT) || sym[i].st_name >= str->sh_size) continue;
+    syms[nr_sym ++] = (Symbol) {
+      .addr = sym[i].st_value, .size = sym[i].st_size, .name = sym_strtab + sym[i].st_name };
+  }
+  qsort(syms, nr_sym, sizeof(Symbol), sym_cmp);
+  Log("%d symbols are loaded from the ELF", nr_sym);
+  free(sym);
+  free(sh);
+}
+
+/* Place each PT_LOAD segment of the ELF at its physical address and
+ * zero the rest of its memory size. All segments should lie after the
+ * reset vector, which the entry should be at. Return the size from the
+ * reset vector to the end of the last segment.
+ */
+long load_elf(int fd) {
+  ELF(Ehdr) *eh = read_at(fd, 0, sizeof(ELF(Ehdr)));
+  Assert(eh->e_ident[EI_CLASS] == ELF_CLASS && eh->e_ident[EI_DATA] == ELFDATA2LSB &&
+      eh->e_machine == ELF_MACHINE, "The ELF is not built for %s", str(__GUEST_ISA__));
+  Assert(eh->e_entry == RESET_VECTOR, "The entry " FMT_WORD " of the ELF should be "
+      "the reset vector " FMT_PADDR, (word_t)eh->e_entry, RESET_VECTOR);
+
+  ELF(Phdr) *ph = read_at(fd, eh->e_phoff, eh->e_phnum * sizeof(ELF(Phdr)));
+  paddr_t end = RESET_VECTOR;
+  int i;
+  for (i = 0; i < eh->e_phnum; i ++) {
+    if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) continue;
+    paddr_t addr = ph[i].p_paddr;
+    Assert(addr >= RESET_VECTOR && ph[i].p_memsz - 1 <= PMEM_RIGHT - addr &&
+        ph[i].p_filesz <= ph[i].p_memsz, "Segment %d [" FMT_PADDR ", " FMT_PADDR ") "
+        "of the ELF is out of [" FMT_PADDR ", " FMT_PADDR "]", i, addr,
+        (paddr_t)(addr + ph[i].p_memsz), RESET_VECTOR, PMEM_RIGHT);
+    Log("Load segment %d to [" FMT_PADDR ", " FMT_PADDR "), file size = %ld", i, addr,
+        (paddr_t)(addr + ph[i].p_memsz), (long)ph[i].p_filesz);
+    pmem_load(fd, ph[i].p_offset, addr, ph[i].p_filesz);
+    pmem_load(-1, 0, addr + ph[i].p_filesz, ph[i].p_memsz - ph[i].p_filesz);
+    if (addr + ph[i].p_memsz > end) end = addr + ph[i].p_memsz;
+  }
+  free(ph);
+
+  if (eh->e_shoff != 0) load_symtab(fd, eh);
+  free(eh);
+  return end - RESET_VECTOR;
+}
+
+const char *elf_symbol(vaddr_t addr, vaddr_t *start) {
+  // the last symbol not after `addr`
+  int l = 0, r = nr_sym;
+  while (l < r) {
+    int m = (l + r) / 2;
+    if (syms[m].addr <= addr) l = m + 1;
+    else r = m;
+  }
+  if (l == 0) return NULL;
+  Symbol *s = &syms[l - 1];
+  if (s->size != 0 && addr - s->addr >= s->size) return NULL;
+  if (start) *start = s->addr;
+  return s->name;
+}
+#endif
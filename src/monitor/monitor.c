@@ -15,6 +15,7 @@
 
 #include <isa.h>
 #include <memory/paddr.h>
+#include <device/capture.h>
 
 void init_rand();
 void init_log(const char *log_file);
@@ -23,6 +24,8 @@ void init_difftest(char *ref_so_file, long img_size, int port);
 void init_device();
 void init_sdb();
 void init_disasm(const char *triple);
+void init_instpat_profile(const char *file);
+void event_set_icount(int shift);
 
 static void welcome() {
   Log("Trace: %s", MUXDEF(CONFIG_TRACE, ANSI_FMT("ON", ANSI_FG_GREEN), ANSI_FMT("OFF", ANSI_FG_RED)));
@@ -38,12 +41,22 @@ static void welcome() {
 
 #ifndef CONFIG_TARGET_AM
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
 
 void sdb_set_batch_mode();
+long load_elf(int fd);
 
 static char *log_file = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
+IFDEF(CONFIG_DECODE_PROFILE, static char *profile_file = NULL);
+IFDEF(CONFIG_DEVICE, static int icount_shift = -1);
+#ifdef CONFIG_VGA_CAPTURE
+static char *capture_dir = NULL, *capture_golden = NULL;
+static int capture_every = 0;
+#endif
 static int difftest_port = 1234;
 
 static long load_img() {
@@ -52,19 +65,22 @@ static long load_img() {
     return 4096; // built-in image size
   }
 
-  FILE *fp = fopen(img_file, "rb");
-  Assert(fp, "Can not open '%s'", img_file);
-
-  fseek(fp, 0, SEEK_END);
-  long size = ftell(fp);
-
-  Log("The image is %s, size = %ld", img_file, size);
-
-  fseek(fp, 0, SEEK_SET);
-  int ret = fread(guest_to_host(RESET_VECTOR), size, 1, fp);
-  assert(ret == 1);
+  int fd = open(img_file, O_RDONLY);
+  Assert(fd >= 0, "Can not open '%s'", img_file);
+
+  char magic[SELFMAG];
+  long size;
+  if (pread(fd, magic, SELFMAG, 0) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0) {
+    Log("The image is %s, an ELF", img_file);
+    size = load_elf(fd);
+  } else {
+    size = lseek(fd, 0, SEEK_END);
+    Log("The image is %s, size = %ld", img_file, size);
+    Assert(size <= (long)PMEM_RIGHT - RESET_VECTOR + 1, "The image is larger than pmem");
+    pmem_load(fd, 0, RESET_VECTOR, size);
+  }
 
-  fclose(fp);
+  close(fd);
   return size;
 }
 
@@ -74,16 +90,32 @@ static int parse_args(int argc, char *argv[]) {
     {"log"      , required_argument, NULL, 'l'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+#ifdef CONFIG_DECODE_PROFILE
+    {"profile"  , required_argument, NULL, 'f'},
+#endif
+#ifdef CONFIG_DEVICE
+    {"icount"   , required_argument, NULL, 'i'},
+#endif
+#ifdef CONFIG_VGA_CAPTURE
+    {"capture"       , required_argument, NULL, 'c'},
+    {"capture-every" , required_argument, NULL, 'e'},
+    {"capture-golden", required_argument, NULL, 'g'},
+#endif
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhl:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhl:d:p:" IFDEF(CONFIG_DECODE_PROFILE, "f:") IFDEF(CONFIG_DEVICE, "i:") IFDEF(CONFIG_VGA_CAPTURE, "c:e:g:"), table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'l': log_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      IFDEF(CONFIG_DECODE_PROFILE, case 'f': profile_file = optarg; break);
+      IFDEF(CONFIG_DEVICE, case 'i': sscanf(optarg, "%d", &icount_shift); break);
+      IFDEF(CONFIG_VGA_CAPTURE, case 'c': capture_dir = optarg; break);
+      IFDEF(CONFIG_VGA_CAPTURE, case 'e': sscanf(optarg, "%d", &capture_every); break);
+      IFDEF(CONFIG_VGA_CAPTURE, case 'g': capture_golden = optarg; break);
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
@@ -91,6 +123,15 @@ static int parse_args(int argc, char *argv[]) {
         printf("\t-l,--log=FILE           output log to FILE\n");
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+        IFDEF(CONFIG_DECODE_PROFILE,
+          printf("\t-f,--profile=FILE       write the INSTPAT() profile to FILE\n"));
+        IFDEF(CONFIG_DEVICE,
+          printf("\t-i,--icount=SHIFT       derive the time of devices from the instruction count,\n"
+                 "\t                        2^SHIFT ns per instruction, for reproducible runs\n"));
+        IFDEF(CONFIG_VGA_CAPTURE,
+          printf("\t-c,--capture=DIR        log the hash of each frame to DIR/frames.log\n"
+                 "\t-e,--capture-every=N    also write every N-th frame to DIR as PNG\n"
+                 "\t-g,--capture-golden=LOG also write the frames whose hash differs from LOG\n"));
         printf("\n");
         exit(0);
     }
@@ -104,16 +145,22 @@ void init_monitor(int argc, char *argv[]) {
   /* Parse arguments. */
   parse_args(argc, argv);
 
-  /* Set random seed. */
-  init_rand();
+  /* Set random seed. A run with --icount should be reproducible. */
+  if (MUXDEF(CONFIG_DEVICE, icount_shift >= 0, false)) srand(0);
+  else init_rand();
 
   /* Open the log file. */
   init_log(log_file);
 
+  /* Set the file to write the INSTPAT() profile. */
+  IFDEF(CONFIG_DECODE_PROFILE, init_instpat_profile(profile_file));
+
   /* Initialize memory. */
   init_mem();
 
   /* Initialize devices. */
+  IFDEF(CONFIG_DEVICE, if (icount_shift >= 0) event_set_icount(icount_shift));
+  IFDEF(CONFIG_VGA_CAPTURE, capture_set(capture_dir, capture_every, capture_golden));
   IFDEF(CONFIG_DEVICE, init_device());
 
   /* Perform ISA dependent initialization. */
@@ -122,6 +169,9 @@ void init_monitor(int argc, char *argv[]) {
   /* Load the image to memory. This will overwrite the built-in image. */
   long img_size = load_img();
 
+  /* Save the loaded image to be restored by `reset`. */
+  IFDEF(CONFIG_PMEM_SNAPSHOT, pmem_snapshot(RESET_VECTOR, img_size));
+
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
 
@@ -52,6 +52,13 @@ static int cmd_q(char *args) {
   return -1;
 }
 
+#ifdef CONFIG_PMEM_SNAPSHOT
+static int cmd_reset(char *args) {
+  cpu_reset();
+  return 0;
+}
+#endif
+
 static int cmd_help(char *args);
 
 static struct {
@@ -62,6 +69,9 @@ static struct {
   { "help", "Display information about all supported commands", cmd_help },
   { "c", "Continue the execution of the program", cmd_c },
   { "q", "Exit NEMU", cmd_q },
+#ifdef CONFIG_PMEM_SNAPSHOT
+  { "reset", "Restore the guest to the state right after loading the image", cmd_reset },
+#endif
 
   /* TODO: Add more commands */
 
@@ -0,0 +1,36 @@
+#***************************************************************************************
+# Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+#
+# NEMU is licensed under Mulan PSL v2.
+# You can use this software according to the terms and conditions of the Mulan PSL v2.
+# You may obtain a copy of Mulan PSL v2 at:
+#          http://license.coscl.org.cn/MulanPSL2
+#
+# THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+# EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+# MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+#
+# See the Mulan PSL v2 for more details.
+#**************************************************************************************/
+
+ifneq ($(CONFIG_DECODE_TREE)$(CONFIG_DECODE_PGO),)
+GEN_DECODE_PATH = $(NEMU_HOME)/tools/gen-decode
+GEN_DECODE = $(GEN_DECODE_PATH)/build/gen-decode
+DECODE_INST_SRC = src/isa/$(GUEST_ISA)/inst.c
+DECODE_INST_OBJ = $(OBJ_DIR)/src/isa/$(GUEST_ISA)/inst.o
+DECODE_GEN = $(OBJ_DIR)/src/isa/$(GUEST_ISA)/decode-gen.h
+DECODE_PROFILE = $(if $(CONFIG_DECODE_PGO),$(call remove_quote,$(CONFIG_DECODE_PGO_PROFILE)),)
+GEN_DECODE_FLAGS = $(if $(CONFIG_DECODE_TREE),,-l) $(if $(DECODE_PROFILE),-p $(DECODE_PROFILE),)
+
+$(GEN_DECODE):
+	$(Q)$(MAKE) $(silent) -C $(GEN_DECODE_PATH)
+
+$(DECODE_GEN): $(DECODE_INST_SRC) $(GEN_DECODE) $(DECODE_PROFILE)
+	@echo + GEN $@
+	@mkdir -p $(dir $@)
+	@$(GEN_DECODE) $(GEN_DECODE_FLAGS) $< > $@.tmp
+	@mv $@.tmp $@
+
+$(DECODE_INST_OBJ): $(DECODE_GEN)
+$(DECODE_INST_OBJ): CFLAGS += -I$(dir $(DECODE_GEN))
+endif
@@ -0,0 +1,492 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+/* Generate a decision tree from the INSTPAT() list in inst.c.
+ *
+ * The tree switches on the bit fields which are fixed in most of the
+ * remaining patterns, and falls back to key/mask comparisons in pattern
+ * order at the leaves. Therefore it always selects the same pattern as
+ * scanning the INSTPAT() list from the beginning. Each execute body is
+ * emitted only once behind a label, and the leaves jump to it.
+ *
+ * With a profile written by NEMU, the patterns are first reordered by
+ * their match counts. A pattern only moves before the patterns it does
+ * not overlap with, so the first matching pattern never changes. With
+ * -l, the reordered INSTPAT() list is emitted instead of a tree.
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#define MAX_PATTERN 1024
+#define MAX_SWITCH_BITS 8
+
+typedef struct {
+  int line;
+  char *str;  // pattern string
+  char *args; // the remaining arguments of INSTPAT(): name, type and execute body
+  uint64_t key, mask;
+  uint64_t count; // number of matches in the profile
+  bool used;
+} Pattern;
+
+typedef struct Node {
+  uint64_t decided; // bits already selected by the switches above
+  // switch on BITS(inst, lo + nr_bits - 1, lo) if `nr_bits > 0`
+  int lo, nr_bits;
+  struct Node **child;
+  // otherwise compare the patterns in `list` in order
+  int *list, n;
+} Node;
+
+static Pattern pat[MAX_PATTERN] = {};
+static int nr_pat = 0;
+static int width = 0; // length of the longest pattern
+static const char *src_file = NULL;
+static bool verbose = false;
+static bool linear = false;
+
+__attribute__((noreturn))
+static void error(int line, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%s:%d: error: ", src_file, line);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(1);
+}
+
+static char *read_file(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) { perror(path); exit(1); }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *buf = malloc(size + 1);
+  assert(buf);
+  int ret = fread(buf, size, 1, fp);
+  assert(size == 0 || ret == 1);
+  buf[size] = '\0';
+  fclose(fp);
+  return buf;
+}
+
+// skip a string or character literal starting at `p`, return the closing quote
+static char *skip_literal(char *p, int *line) {
+  char quote = *p;
+  for (p ++; *p != quote; p ++) {
+    if (*p == '\0') error(*line, "unterminated literal");
+    if (*p == '\\' && p[1] != '\0') p ++;
+    if (*p == '\n') (*line) ++;
+  }
+  return p;
+}
+
+static void pattern_decode(Pattern *pt) {
+  int len = 0;
+  for (char *c = pt->str; *c != '\0'; c ++) {
+    if (*c == ' ') continue;
+    if (*c != '0' && *c != '1' && *c != '?') {
+      error(pt->line, "invalid character '%c' in pattern string", *c);
+    }
+    pt->key  = (pt->key  << 1) | (*c == '1');
+    pt->mask = (pt->mask << 1) | (*c != '?');
+    len ++;
+  }
+  if (len > 64) error(pt->line, "pattern too long");
+  if (len > width) width = len;
+}
+
+// `p` points to the character after "INSTPAT(", return the closing ')'
+static char *parse_instpat(char *p, int *line) {
+  assert(nr_pat < MAX_PATTERN);
+  Pattern *pt = &pat[nr_pat ++];
+  pt->line = *line;
+
+  while (isspace(*p)) { if (*p == '\n') (*line) ++; p ++; }
+  if (*p != '"') error(*line, "the pattern should be a string literal");
+  char *end = skip_literal(p, line);
+  pt->str = strndup(p + 1, end - p - 1);
+  pattern_decode(pt);
+
+  for (p = end + 1; isspace(*p); p ++) { if (*p == '\n') (*line) ++; }
+  if (*p != ',') error(*line, "expected ',' after the pattern string");
+  char *args = ++ p;
+  int depth = 0;
+  for (; depth > 0 || *p != ')'; p ++) {
+    switch (*p) {
+      case '\0': error(pt->line, "unterminated INSTPAT()");
+      case '(': case '[': case '{': depth ++; break;
+      case ')': case ']': case '}': depth --; break;
+      case '"': case '\'': p = skip_literal(p, line); break;
+      case '\n': (*line) ++; break;
+    }
+  }
+  while (isspace(*args)) args ++;
+  pt->args = strndup(args, p - args);
+  return p;
+}
+
+static void parse(char *text) {
+  int line = 1;
+  for (char *p = text; *p != '\0'; p ++) {
+    if (*p == '\n') line ++;
+    else if (p[0] == '/' && p[1] == '/') { while (p[1] != '\0' && p[1] != '\n') p ++; }
+    else if (p[0] == '/' && p[1] == '*') {
+      for (p += 2; *p != '\0' && !(p[0] == '*' && p[1] == '/'); p ++) { if (*p == '\n') line ++; }
+      if (*p == '\0') error(line, "unterminated comment");
+      p ++;
+    }
+    else if (*p == '"' || *p == '\'') p = skip_literal(p, &line);
+    else if (strncmp(p, "INSTPAT(", 8) == 0 && (p == text || !(isalnum(p[-1]) || p[-1] == '_'))) {
+      p = parse_instpat(p + 8, &line);
+    }
+  }
+}
+
+// every instruction matching pattern `j` also matches pattern `i`
+static bool covers(Pattern *i, Pattern *j) {
+  return (i->mask & ~j->mask) == 0 && ((i->key ^ j->key) & i->mask) == 0;
+}
+
+static bool overlaps(Pattern *i, Pattern *j) {
+  return ((i->key ^ j->key) & i->mask & j->mask) == 0;
+}
+
+static void check_patterns() {
+  for (int j = 0; j < nr_pat; j ++) {
+    for (int i = 0; i < j; i ++) {
+      if (covers(&pat[i], &pat[j])) {
+        error(pat[j].line, "pattern \"%s\" is shadowed by \"%s\" at line %d",
+            pat[j].str, pat[i].str, pat[i].line);
+      }
+      // a pattern without fixed bits is the usual catch-all at the end of the list
+      if (pat[i].mask != 0 && pat[j].mask != 0 && overlaps(&pat[i], &pat[j])) {
+        fprintf(stderr, "%s:%d: warning: pattern \"%s\" overlaps with \"%s\" at line %d, "
+            "which takes priority\n", src_file, pat[j].line, pat[j].str, pat[i].str, pat[i].line);
+      }
+    }
+  }
+}
+
+// compare two pattern strings ignoring the spaces
+static bool same_pattern(const char *a, const char *b) {
+  for (;; a ++, b ++) {
+    while (*a == ' ') a ++;
+    while (*b == ' ') b ++;
+    if (*a != *b) return false;
+    if (*a == '\0') return true;
+  }
+}
+
+// each line of the profile is `count "pattern"`
+static void load_profile(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) { perror(path); exit(1); }
+  char line[256], str[256];
+  uint64_t count;
+  int nr_line = 0, nr_unknown = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    nr_line ++;
+    if (sscanf(line, "%" SCNu64 " \"%255[01? ]\"", &count, str) != 2) {
+      fprintf(stderr, "%s:%d: error: expected `count \"pattern\"`\n", path, nr_line);
+      exit(1);
+    }
+    int i;
+    for (i = 0; i < nr_pat && !same_pattern(pat[i].str, str); i ++) ;
+    if (i < nr_pat) pat[i].count += count;
+    else nr_unknown ++;
+  }
+  fclose(fp);
+  if (nr_unknown > 0) {
+    fprintf(stderr, "%s: warning: %d patterns in the profile are not found in %s\n",
+        path, nr_unknown, src_file);
+  }
+}
+
+// Put the pattern with the highest count first, among those whose earlier
+// overlapping patterns are all placed.
+static void order_by_profile(int *list) {
+  static bool placed[MAX_PATTERN] = {};
+  for (int k = 0; k < nr_pat; k ++) {
+    int best = -1;
+    for (int j = 0; j < nr_pat; j ++) {
+      if (placed[j]) continue;
+      bool ready = true;
+      for (int i = 0; i < j && ready; i ++) ready = placed[i] || !overlaps(&pat[i], &pat[j]);
+      if (ready && (best == -1 || pat[j].count > pat[best].count)) best = j;
+    }
+    assert(best != -1);
+    placed[best] = true;
+    list[k] = best;
+  }
+}
+
+static Node *new_leaf(int *list, int n, uint64_t decided) {
+  Node *node = calloc(1, sizeof(Node));
+  assert(node);
+  node->decided = decided;
+  node->list = list;
+  node->n = n;
+  return node;
+}
+
+static Node *build(int *list, int n, uint64_t decided) {
+  // patterns after one which always matches here are never selected
+  for (int k = 0; k < n; k ++) {
+    if ((pat[list[k]].mask & ~decided) == 0) { n = k + 1; break; }
+  }
+  Node *node = new_leaf(list, n, decided);
+  if (n == 0 || (pat[list[0]].mask & ~decided) == 0) return node;
+
+  // score each undecided bit by how many patterns fix it
+  int score[64] = {}, max = 0;
+  for (int k = 0; k < n; k ++) {
+    for (int b = 0; b < width; b ++) {
+      if (((pat[list[k]].mask & ~decided) >> b) & 1) {
+        score[b] ++;
+        if (score[b] > max) max = score[b];
+      }
+    }
+  }
+  if (max < 2) return node;
+
+  // switch on the longest run of bits with the highest score
+  int lo = 0, nr_bits = 0;
+  for (int b = 0; b < width; ) {
+    if (score[b] != max) { b ++; continue; }
+    int start = b;
+    while (b < width && score[b] == max) b ++;
+    if (b - start > nr_bits) { lo = start; nr_bits = b - start; }
+  }
+  if (nr_bits > MAX_SWITCH_BITS) {
+    lo += nr_bits - MAX_SWITCH_BITS;
+    nr_bits = MAX_SWITCH_BITS;
+  }
+  node->lo = lo;
+  node->nr_bits = nr_bits;
+
+  uint64_t field = ((1ull << nr_bits) - 1) << lo;
+  int nr_case = 1 << nr_bits;
+  int *sub[1 << MAX_SWITCH_BITS], nr_sub[1 << MAX_SWITCH_BITS];
+  node->child = calloc(nr_case, sizeof(Node *));
+  assert(node->child);
+  for (int v = 0; v < nr_case; v ++) {
+    uint64_t val = (uint64_t)v << lo;
+    sub[v] = malloc(sizeof(int) * n);
+    assert(sub[v]);
+    nr_sub[v] = 0;
+    for (int k = 0; k < n; k ++) {
+      Pattern *pt = &pat[list[k]];
+      if (((pt->key ^ val) & pt->mask & field) == 0) sub[v][nr_sub[v] ++] = list[k];
+    }
+    // share the subtree with an earlier case with the same candidates
+    for (int u = 0; u < v; u ++) {
+      if (nr_sub[u] == nr_sub[v] && memcmp(sub[u], sub[v], sizeof(int) * nr_sub[v]) == 0) {
+        node->child[v] = node->child[u];
+        break;
+      }
+    }
+    if (node->child[v] == NULL) node->child[v] = build(sub[v], nr_sub[v], decided | field);
+  }
+  return node;
+}
+
+#define INDENT(d) printf("%*s", 2 * (d), "")
+
+static void emit_tree(Node *node, int depth) {
+  if (node->nr_bits == 0) {
+    for (int k = 0; k < node->n; k ++) {
+      Pattern *pt = &pat[node->list[k]];
+      uint64_t mask = pt->mask & ~node->decided;
+      pt->used = true;
+      INDENT(depth);
+      if (mask == 0) { printf("goto __instpat_%d;\n", node->list[k]); return; }
+      printf("if (((uint64_t)INSTPAT_INST(s) & 0x%" PRIx64 "ull) == 0x%" PRIx64 "ull) goto __instpat_%d;\n",
+          mask, pt->key & mask, node->list[k]);
+    }
+    INDENT(depth); printf("goto *(__instpat_end);\n");
+    return;
+  }
+
+  int nr_case = 1 << node->nr_bits;
+  // the child shared by the most cases becomes the default
+  Node *dflt = NULL;
+  int dflt_count = 0;
+  for (int v = 0; v < nr_case; v ++) {
+    int count = 0;
+    for (int u = 0; u < nr_case; u ++) count += (node->child[u] == node->child[v]);
+    if (count > dflt_count) { dflt = node->child[v]; dflt_count = count; }
+  }
+
+  INDENT(depth);
+  printf("switch (BITS((uint64_t)INSTPAT_INST(s), %d, %d)) {\n", node->lo + node->nr_bits - 1, node->lo);
+  for (int v = 0; v < nr_case; v ++) {
+    Node *c = node->child[v];
+    bool emitted = (c == dflt);
+    for (int u = 0; u < v && !emitted; u ++) emitted = (node->child[u] == c);
+    if (emitted) continue;
+    INDENT(depth + 1);
+    for (int u = v; u < nr_case; u ++) {
+      if (node->child[u] == c) printf("%scase 0x%x:", (u == v ? "" : " "), u);
+    }
+    printf("\n");
+    emit_tree(c, depth + 2);
+  }
+  INDENT(depth + 1); printf("default:\n");
+  emit_tree(dflt, depth + 2);
+  INDENT(depth); printf("}\n");
+}
+
+static void emit_bodies() {
+  for (int i = 0; i < nr_pat; i ++) {
+    if (!pat[i].used) {
+      error(pat[i].line, "pattern \"%s\" is shadowed by the patterns before it", pat[i].str);
+    }
+    printf("__instpat_%d:\n", i);
+    printf("#line %d \"%s\"\n", pat[i].line, src_file);
+    printf("  INSTPAT_PROFILE(\"%s\");\n", pat[i].str);
+    printf("  INSTPAT_MATCH(s, %s);\n", pat[i].args);
+    printf("  goto *(__instpat_end);\n");
+  }
+}
+
+static void emit_list(int *list) {
+  for (int k = 0; k < nr_pat; k ++) {
+    Pattern *pt = &pat[list[k]];
+    printf("#line %d \"%s\"\n", pt->line, src_file);
+    printf("  INSTPAT(\"%s\", %s);\n", pt->str, pt->args);
+  }
+}
+
+static int select_linear(int *list, uint64_t inst, int *nr_cmp) {
+  for (int k = 0; k < nr_pat; k ++) {
+    (*nr_cmp) ++;
+    if ((inst & pat[list[k]].mask) == pat[list[k]].key) return list[k];
+  }
+  return -1;
+}
+
+static int select_tree(Node *node, uint64_t inst, int *nr_cmp) {
+  for (; node->nr_bits > 0; (*nr_cmp) ++) {
+    node = node->child[(inst >> node->lo) & ((1ull << node->nr_bits) - 1)];
+  }
+  for (int k = 0; k < node->n; k ++) {
+    Pattern *pt = &pat[node->list[k]];
+    uint64_t mask = pt->mask & ~node->decided;
+    if (mask == 0) return node->list[k];
+    (*nr_cmp) ++;
+    if ((inst & mask) == (pt->key & mask)) return node->list[k];
+  }
+  return -1;
+}
+
+static uint64_t rand64() {
+  return ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ rand();
+}
+
+// cross-check the generated decoder with the INSTPAT() list in source order
+static void verify(Node *root, int *order) {
+  static int source[MAX_PATTERN];
+  for (int k = 0; k < nr_pat; k ++) source[k] = k;
+  const char *gen_name = (root != NULL ? "decode tree" : "profile order");
+  uint64_t wmask = (width == 64 ? ~0ull : (1ull << width) - 1);
+  int nr_sample = 0, max_linear = 0, max_gen = 0;
+  long sum_linear = 0, sum_gen = 0;
+  double weighted_linear = 0, weighted_gen = 0;
+  uint64_t total_count = 0;
+  srand(0);
+  for (int i = -1; i < nr_pat; i ++) {
+    int nr_trial = (i == -1 ? 100000 : 1000);
+    long pat_linear = 0, pat_gen = 0;
+    for (int t = 0; t < nr_trial; t ++) {
+      uint64_t inst = rand64() & wmask;
+      if (i >= 0) inst = pat[i].key | (inst & ~pat[i].mask);
+      int nr_linear = 0, nr_gen = 0;
+      int expect = select_linear(source, inst, &nr_linear);
+      int actual = (root != NULL ? select_tree(root, inst, &nr_gen) : select_linear(order, inst, &nr_gen));
+      if (expect != actual) {
+        error(actual >= 0 ? pat[actual].line : 0, "internal error: the %s selects "
+            "pattern #%d for 0x%" PRIx64 ", but the ordered list selects #%d", gen_name, actual, inst, expect);
+      }
+      nr_sample ++;
+      sum_linear += nr_linear; sum_gen += nr_gen;
+      pat_linear += nr_linear; pat_gen += nr_gen;
+      if (nr_linear > max_linear) max_linear = nr_linear;
+      if (nr_gen > max_gen) max_gen = nr_gen;
+    }
+    if (i >= 0) {
+      weighted_linear += (double)pat[i].count * pat_linear / nr_trial;
+      weighted_gen += (double)pat[i].count * pat_gen / nr_trial;
+      total_count += pat[i].count;
+    }
+  }
+  if (verbose) {
+    fprintf(stderr, "%s: %d patterns, compares per instruction: "
+        "ordered list avg %.2f max %d, %s avg %.2f max %d\n", src_file, nr_pat,
+        (double)sum_linear / nr_sample, max_linear, gen_name, (double)sum_gen / nr_sample, max_gen);
+    if (total_count > 0) {
+      fprintf(stderr, "%s: weighted by the profile: ordered list avg %.2f, %s avg %.2f\n",
+          src_file, weighted_linear / total_count, gen_name, weighted_gen / total_count);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *profile = NULL;
+  int i;
+  for (i = 1; i < argc && argv[i][0] == '-'; i ++) {
+    if (strcmp(argv[i], "-v") == 0) verbose = true;
+    else if (strcmp(argv[i], "-l") == 0) linear = true;
+    else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) profile = argv[++ i];
+    else break;
+  }
+  if (i + 1 != argc) {
+    fprintf(stderr, "Usage: %s [-v] [-l] [-p profile] inst.c > decode-gen.h\n", argv[0]);
+    return 1;
+  }
+  src_file = argv[i];
+  parse(read_file(src_file));
+  if (nr_pat == 0) error(1, "no INSTPAT() is found");
+  check_patterns();
+
+  static int list[MAX_PATTERN];
+  for (int k = 0; k < nr_pat; k ++) list[k] = k;
+  if (profile != NULL) {
+    load_profile(profile);
+    order_by_profile(list);
+  }
+
+  printf("// Generated by tools/gen-decode from %s%s%s. DO NOT EDIT.\n", src_file,
+      (profile != NULL ? " and " : ""), (profile != NULL ? profile : ""));
+  if (linear) {
+    emit_list(list);
+    verify(NULL, list);
+  } else {
+    Node *root = build(list, nr_pat, 0);
+    emit_tree(root, 0);
+    emit_bodies();
+    verify(root, list);
+  }
+  return 0;
+}